@@ -0,0 +1,328 @@
+#include "atlas_builder.hpp"
+#include "mpmc_queue.hpp"
+#include "parallel.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <chrono>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace ::atlas2d;
+using namespace ::std;
+
+namespace {
+    
+    /// Content of a file read by the I/O stage
+    struct read_item {
+        size_t job = 0;
+        raw_data_ptr data;
+        size_t bytes = 0;
+    };
+    
+    /// A sprite decoded by the decode stage
+    struct decoded_item {
+        size_t job = 0;
+        shared_ptr<raw_pixel_area> area;
+    };
+    
+    /// Spins for a while, then yields and sleeps, so the idle stages don't burn the CPU
+    class backoff {
+    public:
+        void operator()() {
+            if(++_spins < 16)
+                this_thread::yield();
+            else
+                this_thread::sleep_for(chrono::microseconds(_spins < 64 ? 10 : 200));
+        }
+        
+    private:
+        int _spins = 0;
+    };
+    
+    /// Counts the running producers of a stage, the last one marks the stage finished
+    struct stage_state {
+        explicit stage_state(size_t producers): producers(producers) { ;; }
+        
+        void producer_done() {
+            if(producers.fetch_sub(1, memory_order_acq_rel) == 1)
+                finished.store(true, memory_order_release);
+        }
+        
+        atomic<size_t> producers;
+        atomic<bool> finished{false};
+    };
+    
+    /// Pushes the item, waits while the queue is full
+    template<typename T>
+    void push(details::mpmc_queue<T>& queue, T&& item) {
+        backoff wait;
+        while(!queue.try_push(std::move(item)))
+            wait();
+    }
+    
+    /// Pops an item, waits while the queue is empty. Returns false when the producers are done
+    /// and the queue is drained.
+    template<typename T>
+    bool pop(details::mpmc_queue<T>& queue, stage_state const& producers, T& item) {
+        backoff wait;
+        for(;;) {
+            // The flag is checked before the pop, so an empty queue after it is really the end
+            bool finished = producers.finished.load(memory_order_acquire);
+            if(queue.try_pop(item))
+                return true;
+            if(finished)
+                return false;
+            wait();
+        }
+    }
+    
+    /// Opens the file and asks the kernel to start reading it into the page cache, so it's there
+    /// when it's read. Returns the descriptor or -1.
+    int open_advised(string const& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0)
+            return -1;
+        
+#if defined(POSIX_FADV_WILLNEED)
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+        struct stat info;
+        if(::fstat(fd, &info) == 0 && info.st_size > 0) {
+            struct radvisory advice;
+            advice.ra_offset = 0;
+            advice.ra_count = (int)(std::min)(info.st_size, (off_t)INT_MAX);
+            ::fcntl(fd, F_RDADVISE, &advice);
+        }
+#endif
+        return fd;
+    }
+    
+    /// Counts of the threads of the stages
+    struct stage_threads {
+        size_t io = 0;
+        size_t decode = 0;
+        size_t fill = 0;
+    };
+    
+    /// The stages not given a count share the CPUs, so the pipeline doesn't oversubscribe them.
+    /// Decoding usually costs more than filling, so it gets the larger share.
+    stage_threads threads_of(pipeline_params const& params, size_t jobs) {
+        const size_t cpus = details::default_workers_count();
+        
+        stage_threads t;
+        t.io = params.io_threads ? params.io_threads : (std::max)((size_t)1, cpus / 8);
+        
+        size_t left = cpus > t.io ? cpus - t.io : 0;
+        if(params.decode_threads)
+            left = left > params.decode_threads ? left - params.decode_threads : 0;
+        if(params.fill_threads)
+            left = left > params.fill_threads ? left - params.fill_threads : 0;
+        
+        if(!params.decode_threads && !params.fill_threads) {
+            t.decode = left - left / 2;
+            t.fill = left / 2;
+        }
+        else {
+            t.decode = params.decode_threads ? params.decode_threads : left;
+            t.fill = params.fill_threads ? params.fill_threads : left;
+        }
+        
+        // workers_count_for() turns zero to the count of CPUs, so at least one thread is given
+        t.decode = (std::max)((size_t)1, t.decode);
+        t.fill = (std::max)((size_t)1, t.fill);
+        
+        t.io = details::workers_count_for(jobs, t.io);
+        t.decode = details::workers_count_for(jobs, t.decode);
+        t.fill = details::workers_count_for(jobs, t.fill);
+        return t;
+    }
+    
+    /// Reads the whole file and closes it. The kernel is asked to read ahead the file sequentially.
+    /// While the budget is exhausted, waits for the <held> files of the pipeline to be released;
+    /// fails only if none is held, so the file doesn't fit the budget at all.
+    bool read_file(int fd, memory_account_ptr const& account, atomic<size_t>& held, read_item& item) {
+        if(fd < 0)
+            return false;
+        
+        struct stat info;
+        if(::fstat(fd, &info) != 0 || info.st_size < 0) {
+            ::close(fd);
+            return false;
+        }
+        
+#if defined(POSIX_FADV_SEQUENTIAL)
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#elif defined(F_RDAHEAD)
+        ::fcntl(fd, F_RDAHEAD, 1);
+#endif
+        
+        const size_t bytes = (size_t)info.st_size;
+        item.bytes = bytes;
+        
+        backoff wait;
+        while(bytes && !(item.data = details::allocate_tracked(bytes, account))) {
+            if(!held.load(memory_order_acquire))
+                break;
+            wait();
+        }
+        bool result = item.data || !bytes;
+        if(result)
+            ++held;
+        
+        size_t done = 0;
+        while(result && done < bytes) {
+            ssize_t got = ::pread(fd, item.data.get() + done, bytes - done, (off_t)done);
+            if(got < 0 && errno == EINTR)
+                continue;
+            
+            result = got > 0;
+            done += result ? (size_t)got : 0;
+        }
+        
+        ::close(fd);
+        if(!result && item.data) {
+            item.data.reset();
+            --held;
+        }
+        return result;
+    }
+    
+} // namespace
+
+
+bool atlas2d::build_atlas(vector<sprite_job> const& jobs,
+                          sprite_decoder const& decoder,
+                          pipeline_params const& params,
+                          pipeline_stats& stats)
+{
+    stats = pipeline_stats();
+    if(!decoder)
+        return jobs.empty();
+    
+    auto started = chrono::steady_clock::now();
+    
+    const auto threads = threads_of(params, jobs.size());
+    const size_t io_threads = threads.io;
+    const size_t decode_threads = threads.decode;
+    const size_t fill_threads = threads.fill;
+    const size_t depth = (max)((size_t)1, params.queue_depth);
+    
+    details::mpmc_queue<read_item> read_queue(depth);
+    details::mpmc_queue<decoded_item> decoded_queue(depth);
+    
+    stage_state readers(io_threads);
+    stage_state decoders(decode_threads);
+    
+    // The descriptors of the files opened ahead, the reader takes the one of its file
+    const int no_descriptor = -1;
+    const int taken_descriptor = -2;
+    unique_ptr<atomic<int>[]> descriptors(new atomic<int>[jobs.size()]);
+    for(size_t i = 0; i < jobs.size(); ++i)
+        descriptors[i].store(no_descriptor, memory_order_relaxed);
+    
+    // Buffers of the files read and not filled yet, the readers wait for them when the budget is exhausted
+    atomic<size_t> held{0};
+    
+    atomic<size_t> next_job{0};
+    atomic<size_t> next_advised{1};
+    atomic<size_t> sprites{0}, read_failed{0}, decode_failed{0}, fill_failed{0};
+    atomic<uint64_t> bytes_read{0};
+    
+    auto read_stage = [&]() {
+        for(size_t job = next_job++; job < jobs.size(); job = next_job++) {
+            // The files queued next are opened and prefetched while this one is read, each one once
+            const size_t advise_to = (min)(jobs.size(), job + 1 + params.read_ahead);
+            size_t advised = next_advised.load(memory_order_relaxed);
+            while(advised < advise_to) {
+                if(!next_advised.compare_exchange_weak(advised, advised + 1, memory_order_relaxed))
+                    continue;
+                
+                // The reader of the file may be faster and open it itself
+                int fd = open_advised(jobs[advised].path);
+                int expected = no_descriptor;
+                if(fd >= 0 && !descriptors[advised].compare_exchange_strong(expected, fd, memory_order_acq_rel))
+                    ::close(fd);
+                ++advised;
+            }
+            
+            int fd = descriptors[job].exchange(taken_descriptor, memory_order_acq_rel);
+            if(fd < 0)
+                fd = ::open(jobs[job].path.c_str(), O_RDONLY);
+            
+            read_item item;
+            item.job = job;
+            if(!read_file(fd, params.memory_account, held, item)) {
+                ++read_failed;
+                continue;
+            }
+            
+            bytes_read += item.bytes;
+            push(read_queue, std::move(item));
+        }
+        readers.producer_done();
+    };
+    
+    auto decode_stage = [&]() {
+        read_item item;
+        while(pop(read_queue, readers, item)) {
+            decoded_item decoded;
+            decoded.job = item.job;
+            decoded.area = decoder(item.data.get(), item.bytes, jobs[item.job]);
+            
+            // The file content isn't needed anymore
+            item = read_item();
+            
+            if(!decoded.area) {
+                ++decode_failed;
+                --held;
+                continue;
+            }
+            
+            push(decoded_queue, std::move(decoded));
+        }
+        decoders.producer_done();
+    };
+    
+    auto fill_stage = [&]() {
+        decoded_item item;
+        while(pop(decoded_queue, decoders, item)) {
+            auto const& job = jobs[item.job];
+            if(job.page && job.page->fill_image(*item.area, job.filling))
+                ++sprites;
+            else
+                ++fill_failed;
+            
+            item = decoded_item();
+            --held;
+        }
+    };
+    
+    vector<thread> pool;
+    pool.reserve(io_threads + decode_threads + fill_threads);
+    for(size_t i = 0; i < io_threads; ++i)
+        pool.emplace_back(read_stage);
+    for(size_t i = 0; i < decode_threads; ++i)
+        pool.emplace_back(decode_stage);
+    for(size_t i = 1; i < fill_threads; ++i)
+        pool.emplace_back(fill_stage);
+    
+    // The calling thread fills too
+    fill_stage();
+    
+    for(auto& t : pool)
+        t.join();
+    
+    stats.sprites = sprites;
+    stats.read_failed = read_failed;
+    stats.decode_failed = decode_failed;
+    stats.fill_failed = fill_failed;
+    stats.bytes_read = bytes_read;
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    
+    return stats.sprites == jobs.size();
+}
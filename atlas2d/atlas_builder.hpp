@@ -0,0 +1,65 @@
+#pragma once
+
+#include "raw_image.hpp"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace atlas2d {
+    
+    /// A sprite file to be read, decoded and filled to a page
+    struct sprite_job {
+        std::string path;
+        raw_image* page = nullptr;          ///< The page must stay alive while the build runs
+        raw_image::filling_props filling;   ///< Where and how the sprite is filled
+    };
+    
+    /// Decodes the content of a sprite file. Returns nullptr if the data can't be decoded.
+    /// Called from several threads at once.
+    using sprite_decoder = std::function<std::shared_ptr<raw_pixel_area>(unsigned char const* data,
+                                                                         size_t bytes,
+                                                                         sprite_job const& job)>;
+    
+    /// A set of parameters of the build pipeline
+    struct pipeline_params {
+        size_t io_threads = 0;          ///< Threads reading the files, 0 means one per 8 CPUs (one at least)
+        size_t decode_threads = 0;      ///< Threads decoding the files, 0 means a share of the CPUs left
+        size_t fill_threads = 0;        ///< Threads filling the pages, 0 means a share of the CPUs left
+                                        ///< (all of the stages together take about the count of CPUs)
+        size_t queue_depth = 16;        ///< Capacity of the queues between the stages, bounds the memory in flight
+        size_t read_ahead = 8;          ///< Files past the ones being read opened ahead and prefetched by the kernel
+        memory_account_ptr memory_account;  ///< Account charged for the file contents (optional), the readers wait
+                                            ///< while it's exhausted until the sprites in flight are filled
+    };
+    
+    // Helper
+    struct set_pipeline_params: pipeline_params {
+        using self = set_pipeline_params;
+        self& set_io_threads(size_t arg) {io_threads=arg; return *this;}
+        self& set_decode_threads(size_t arg) {decode_threads=arg; return *this;}
+        self& set_fill_threads(size_t arg) {fill_threads=arg; return *this;}
+        self& set_queue_depth(size_t arg) {queue_depth=arg; return *this;}
+        self& set_read_ahead(size_t arg) {read_ahead=arg; return *this;}
+        self& set_memory_account(memory_account_ptr arg) {memory_account=std::move(arg); return *this;}
+    };
+    
+    /// Results of the build
+    struct pipeline_stats {
+        size_t sprites = 0;         ///< Sprites filled successfully
+        size_t read_failed = 0;     ///< Files which couldn't be read or don't fit the memory account at all
+        size_t decode_failed = 0;   ///< Files the decoder rejected
+        size_t fill_failed = 0;     ///< Sprites fill_image() returned false for
+        uint64_t bytes_read = 0;
+        double seconds = 0;         ///< Wall time of the build
+    };
+    
+    /// Reads, decodes and fills the sprites by a pipeline of stages connected by bounded
+    /// lock-free queues, so the disk I/O, the decoding and the filling overlap.
+    /// The placements of the jobs must not overlap. Returns true if every sprite is filled.
+    bool build_atlas(std::vector<sprite_job> const& jobs,
+                     sprite_decoder const& decoder,
+                     pipeline_params const& params,
+                     pipeline_stats& stats);
+    
+} // namespace atlas2d
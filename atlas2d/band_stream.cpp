@@ -0,0 +1,119 @@
+#include "band_stream.hpp"
+#include "pixel_format.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+using namespace ::atlas2d;
+using namespace ::std;
+
+namespace {
+    
+    /// Rows of the page a placement touches, the mirrored padding included
+    struct placement_extent {
+        int top = 0;
+        int bottom = 0;
+        size_t index = 0;
+    };
+    
+} // namespace
+
+
+bool atlas2d::stream_bands(raw_image_props const& page,
+                           vector<band_placement> const& placements,
+                           band_params const& params,
+                           band_sink const& sink)
+{
+    const int height = page.dimensions.height;
+    const size_t row_bytes = (size_t)page.dimensions.width * pixel_format_details(page.format).bpp;
+    if(height <= 0 || !row_bytes || params.band_rows <= 0 || !sink)
+        return false;
+    
+    const int band_rows = (min)(params.band_rows, height);
+    
+    raw_image band;
+    raw_image::init_props props;
+    static_cast<raw_image_props&>(props) = page;
+    band.init(props.set_raw_data(nullptr).set_storage(raw_storage::band).set_window(0, band_rows));
+    
+    bool result = true;
+    const int padding = page.padding_between_sprites;
+    vector<placement_extent> extents;
+    extents.reserve(placements.size());
+    for(size_t i = 0; i < placements.size(); ++i) {
+        auto const& p = placements[i];
+        int y = p.filling.offset_pos.y;
+        int rows = p.area ? p.area->get_dimensions().height : 0;
+        
+        // Such a placement would never cross a band
+        if(!p.area || y < 0 || y + rows > height) {
+            result = false;
+            continue;
+        }
+        
+        placement_extent e;
+        e.top = (max)(0, y - padding);
+        e.bottom = (min)(height, y + rows + padding);
+        e.index = i;
+        extents.push_back(e);
+    }
+    
+    sort(extents.begin(), extents.end(), [](placement_extent const& a, placement_extent const& b){
+        return a.top < b.top;
+    });
+    
+    // Rows of the bands nothing has been filled to yet
+    vector<unsigned char> zeros;
+    
+    size_t next = 0;
+    vector<placement_extent> active;
+    
+    for(int top = 0; top < height; top += band_rows) {
+        const int bottom = (min)(top + band_rows, height);
+        band.move_window(top);
+        
+        // The placements crossing the band
+        for(; next < extents.size() && extents[next].top < bottom; ++next)
+            active.push_back(extents[next]);
+        
+        active.erase(remove_if(active.begin(), active.end(), [top](placement_extent const& e){
+            return e.bottom <= top;
+        }), active.end());
+        
+        // The layers of packed channels share their pixels, so they're filled one by one in the order
+        // of the placements, the others run in parallel
+        vector<size_t> plain, packed;
+        for(auto const& e : active)
+            (placements[e.index].filling.target_channel >= 0 ? packed : plain).push_back(e.index);
+        sort(packed.begin(), packed.end());
+        
+        atomic<bool> filled{true};
+        details::parallel_for(plain.size(), [&](size_t begin, size_t end, size_t) {
+            for(size_t i = begin; i < end; ++i) {
+                auto const& p = placements[plain[i]];
+                if(!p.area || !band.fill_image(*p.area, p.filling))
+                    filled = false;
+            }
+        }, params.threads);
+        
+        for(auto index : packed) {
+            auto const& p = placements[index];
+            if(!p.area || !band.fill_image(*p.area, p.filling))
+                filled = false;
+        }
+        
+        result = result && filled;
+        
+        unsigned char const* pixels = band.get_raw_pixels();
+        if(!pixels) {
+            zeros.resize(row_bytes * band_rows);
+            pixels = zeros.data();
+        }
+        
+        if(!sink(pixels, top, bottom - top, row_bytes))
+            return false;
+    }
+    
+    return result;
+}
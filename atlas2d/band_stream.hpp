@@ -0,0 +1,43 @@
+#pragma once
+
+#include "raw_image.hpp"
+
+#include <functional>
+#include <vector>
+
+namespace atlas2d {
+    
+    /// A sprite placed to the streamed page
+    struct band_placement {
+        raw_pixel_area const* area = nullptr;
+        raw_image::filling_props filling;
+    };
+    
+    /// Receives a finished band: <rows> rows of the page from <first_row>, <row_bytes> each.
+    /// Returns false to stop the streaming.
+    using band_sink = std::function<bool(unsigned char const* pixels, int first_row, int rows, size_t row_bytes)>;
+    
+    /// A set of parameters of the streaming
+    struct band_params {
+        int band_rows = 64;     ///< Height of a band
+        size_t threads = 0;     ///< Workers filling the sprites of a band, 0 means the count of CPUs
+    };
+    
+    // Helper
+    struct set_band_params: band_params {
+        using self = set_band_params;
+        self& set_band_rows(int arg) {band_rows=arg; return *this;}
+        self& set_threads(size_t arg) {threads=arg; return *this;}
+    };
+    
+    /// Fills the page band by band from the top to the bottom, only a single band is kept in memory.
+    /// Placements are sorted by y, every band gets the sprites (and their mirrored padding) crossing it,
+    /// then the band is handed to the sink. The sprites packed to channels are filled one by one.
+    /// The storage, the window and the data of the <page> props are overridden.
+    /// Returns false if any sprite isn't filled or the sink stops the streaming.
+    bool stream_bands(raw_image_props const& page,
+                      std::vector<band_placement> const& placements,
+                      band_params const& params,
+                      band_sink const& sink);
+    
+} // namespace atlas2d
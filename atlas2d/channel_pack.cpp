@@ -0,0 +1,136 @@
+#include "channel_pack.hpp"
+#include "raw_image.hpp"
+#include "parallel.hpp"
+
+#include <atomic>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+using namespace ::atlas2d;
+using namespace ::atlas2d::details;
+
+void details::extract_channel_rgba8(unsigned char const* src, unsigned char* plane, size_t count, int channel) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    // 16 pixels at once: the channel is shifted to the low byte of each pixel, then the pixels are narrowed
+    const __m128i shift = _mm_cvtsi32_si128(channel * 8);
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    
+    for(; i + 16 <= count; i += 16) {
+        __m128i const* px = (__m128i const*)&src[i * 4];
+        __m128i quads[4];
+        for(int q = 0; q < 4; ++q)
+            quads[q] = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(&px[q]), shift), mask);
+        
+        __m128i lo = _mm_packs_epi32(quads[0], quads[1]);
+        __m128i hi = _mm_packs_epi32(quads[2], quads[3]);
+        _mm_storeu_si128((__m128i*)&plane[i], _mm_packus_epi16(lo, hi));
+    }
+#elif defined(__ARM_NEON)
+    for(; i + 16 <= count; i += 16)
+        vst1q_u8(&plane[i], vld4q_u8(&src[i * 4]).val[channel]);
+#endif
+    for(; i < count; ++i)
+        plane[i] = src[i * 4 + channel];
+}
+
+void details::insert_channel_rgba8(unsigned char* pixels, unsigned char const* plane, size_t count, int channel) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    // 16 pixels at once: the plane bytes are widened to 32 bits and shifted to the channel
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i shift = _mm_cvtsi32_si128(channel * 8);
+    const __m128i keep = _mm_set1_epi32(~(0xFF << (channel * 8)));
+    
+    for(; i + 16 <= count; i += 16) {
+        __m128i values = _mm_loadu_si128((__m128i const*)&plane[i]);
+        __m128i lo = _mm_unpacklo_epi8(values, zero);
+        __m128i hi = _mm_unpackhi_epi8(values, zero);
+        __m128i quads[4] = {
+            _mm_unpacklo_epi16(lo, zero),
+            _mm_unpackhi_epi16(lo, zero),
+            _mm_unpacklo_epi16(hi, zero),
+            _mm_unpackhi_epi16(hi, zero),
+        };
+        
+        for(int q = 0; q < 4; ++q) {
+            __m128i* dst = (__m128i*)&pixels[(i + q * 4) * 4];
+            __m128i px = _mm_and_si128(_mm_loadu_si128(dst), keep);
+            _mm_storeu_si128(dst, _mm_or_si128(px, _mm_sll_epi32(quads[q], shift)));
+        }
+    }
+#elif defined(__ARM_NEON)
+    for(; i + 16 <= count; i += 16) {
+        uint8x16x4_t px = vld4q_u8(&pixels[i * 4]);
+        px.val[channel] = vld1q_u8(&plane[i]);
+        vst4q_u8(&pixels[i * 4], px);
+    }
+#endif
+    for(; i < count; ++i)
+        pixels[i * 4 + channel] = plane[i];
+}
+
+void details::insert_channel_rgba4(unsigned char* pixels, unsigned char const* plane, size_t count, int channel) {
+    // R is in the highest nibble, A is in the lowest one
+    const int bits = 12 - channel * 4;
+    const uint16_t keep = (uint16_t)~(0xF << bits);
+    
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i shift = _mm_cvtsi32_si128(bits);
+    const __m128i keep8 = _mm_set1_epi16((short)keep);
+    
+    for(; i + 8 <= count; i += 8) {
+        __m128i values = _mm_loadl_epi64((__m128i const*)&plane[i]);
+        __m128i nibbles = _mm_srli_epi16(_mm_unpacklo_epi8(values, zero), 4);
+        __m128i* dst = (__m128i*)&pixels[i * 2];
+        __m128i px = _mm_and_si128(_mm_loadu_si128(dst), keep8);
+        _mm_storeu_si128(dst, _mm_or_si128(px, _mm_sll_epi16(nibbles, shift)));
+    }
+#elif defined(__ARM_NEON)
+    const int16x8_t shift = vdupq_n_s16((int16_t)bits);
+    const uint16x8_t keep8 = vdupq_n_u16(keep);
+    
+    for(; i + 8 <= count; i += 8) {
+        uint16x8_t nibbles = vshrq_n_u16(vmovl_u8(vld1_u8(&plane[i])), 4);
+        uint16_t* dst = (uint16_t*)&pixels[i * 2];
+        uint16x8_t px = vandq_u16(vld1q_u16(dst), keep8);
+        vst1q_u16(dst, vorrq_u16(px, vshlq_u16(nibbles, shift)));
+    }
+#endif
+    uint16_t* px = (uint16_t*)pixels;
+    for(; i < count; ++i)
+        px[i] = (uint16_t)((px[i] & keep) | ((plane[i] >> 4) << bits));
+}
+
+bool atlas2d::fill_channel_layers(raw_image& page, channel_layers const& layers, int source_channel, size_t threads) {
+    bool result = true;
+    
+    // Layers share the pixels, so they go one after another
+    for(int channel = 0; channel < 4; ++channel) {
+        auto const& layer = layers[channel];
+        std::atomic<bool> succeeded{true};
+        
+        parallel_for(layer.size(), [&](size_t begin, size_t end, size_t) {
+            for(size_t i = begin; i < end; ++i) {
+                auto const& sprite = layer[i];
+                bool filled = sprite.area && page.fill_image(*sprite.area,
+                                                             raw_image::filling_props()
+                                                             .set_offset(sprite.position)
+                                                             .pack_to_channel(channel, source_channel));
+                if(!filled)
+                    succeeded = false;
+            }
+        }, threads);
+        
+        result = result && succeeded;
+    }
+    
+    return result;
+}
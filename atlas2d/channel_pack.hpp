@@ -0,0 +1,43 @@
+#pragma once
+
+#include "forwards.hpp"
+
+#include <array>
+#include <cstddef>
+#include <vector>
+
+namespace atlas2d {
+    
+    class raw_image;
+    class raw_pixel_area;
+    
+    /// A single-channel sprite of a layer
+    struct channel_sprite {
+        raw_pixel_area const* area = nullptr;
+        offset position = offset(0, 0);
+    };
+    
+    using channel_layer = std::vector<channel_sprite>;
+    
+    /// Layers of R, G, B and A planes of a page
+    using channel_layers = std::array<channel_layer, 4>;
+    
+    /// Fills every layer to its channel of an rgba8 or rgba4 page. The <source_channel> of the sprites
+    /// is taken (3 suits a8 sprites and alpha masks). Sprites of a layer are filled in parallel,
+    /// so they must not overlap. Returns false if any of the sprites isn't filled.
+    bool fill_channel_layers(raw_image& page, channel_layers const& layers, int source_channel = 3, size_t threads = 0);
+    
+    namespace details {
+        
+        /// Copies the channel of rgba8 pixels to the plane
+        void extract_channel_rgba8(unsigned char const* src, unsigned char* plane, size_t count, int channel);
+        
+        /// Replaces the channel of rgba8 pixels by the plane
+        void insert_channel_rgba8(unsigned char* pixels, unsigned char const* plane, size_t count, int channel);
+        
+        /// Replaces the channel of rgba4 pixels by the plane, the values are reduced to 4 bits
+        void insert_channel_rgba4(unsigned char* pixels, unsigned char const* plane, size_t count, int channel);
+        
+    } // namespace details
+    
+} // namespace atlas2d
@@ -0,0 +1,254 @@
+#include "compressed_storage.hpp"
+#include "memory_budget.hpp"
+#include "lz_codec.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+using namespace ::atlas2d;
+using namespace ::atlas2d::details;
+
+namespace {
+    
+    bool charge(memory_account_ptr const& account, size_t bytes) {
+        return !account || !bytes || account->acquire(bytes);
+    }
+    
+    void uncharge(memory_account_ptr const& account, size_t bytes) {
+        if(account && bytes)
+            account->release(bytes);
+    }
+    
+} // namespace
+
+
+compressed_storage_ptr compressed_storage::create(size dims,
+                                                  size_t bpp,
+                                                  int tile_size,
+                                                  size_t cache_tiles,
+                                                  memory_account_ptr account)
+{
+    if(dims.width <= 0 || dims.height <= 0 || !bpp || tile_size <= 0)
+        return nullptr;
+    
+    compressed_storage_ptr storage(new compressed_storage);
+    storage->_dims = dims;
+    storage->_bpp = bpp;
+    storage->_tile = tile_size;
+    storage->_columns = (dims.width + tile_size - 1) / tile_size;
+    storage->_tile_bytes = (size_t)tile_size * tile_size * bpp;
+    storage->_cache_tiles = (std::max)((size_t)1, cache_tiles);
+    storage->_configured_tiles = storage->_cache_tiles;
+    storage->_account = std::move(account);
+    
+    const size_t rows = (dims.height + tile_size - 1) / tile_size;
+    storage->_slots_count = (size_t)storage->_columns * rows;
+    storage->_slots.reset(new tile_slot[storage->_slots_count]);
+    return storage;
+}
+
+compressed_storage::~compressed_storage() {
+    uncharge(_account, _packed_bytes + _cached_tiles * _tile_bytes);
+}
+
+bool compressed_storage::read(int x, int y, unsigned char* dst, size_t count) const {
+    return for_each_piece(x, y, count, [&](size_t index, size_t tile_offset, size_t row_offset, size_t bytes) {
+        return access(index, [&](tile_slot& tile) {
+            std::memcpy(&dst[row_offset], &tile.pixels[tile_offset], bytes);
+        });
+    });
+}
+
+bool compressed_storage::write(int x, int y, unsigned char const* src, size_t count) {
+    return for_each_piece(x, y, count, [&](size_t index, size_t tile_offset, size_t row_offset, size_t bytes) {
+        return access(index, [&](tile_slot& tile) {
+            std::memcpy(&tile.pixels[tile_offset], &src[row_offset], bytes);
+            tile.dirty = true;
+        });
+    });
+}
+
+void compressed_storage::fit_row(size_t count) {
+    // A row not aligned to the tiles touches one more tile
+    const size_t tiles = (std::min)(count / _tile + 2, (size_t)_columns);
+    
+    std::lock_guard<std::mutex> lock(_lru_guard);
+    _cache_tiles = (std::max)(_cache_tiles, tiles);
+    ++_fitting_rows;
+}
+
+void compressed_storage::release_row() {
+    std::vector<size_t> victims;
+    {
+        std::lock_guard<std::mutex> lock(_lru_guard);
+        if(!_fitting_rows || --_fitting_rows)
+            return;
+        
+        _cache_tiles = _configured_tiles;
+        while(_lru.size() > _cache_tiles) {
+            victims.push_back(_lru.back());
+            _slots[victims.back()].in_lru = false;
+            _lru.pop_back();
+        }
+    }
+    
+    for(auto index : victims)
+        evict(index);
+}
+
+bool compressed_storage::flush() {
+    std::vector<size_t> cached;
+    {
+        std::lock_guard<std::mutex> lock(_lru_guard);
+        cached.assign(_lru.begin(), _lru.end());
+    }
+    
+    for(auto index : cached) {
+        auto& tile = _slots[index];
+        std::lock_guard<std::mutex> lock(tile.guard);
+        if(tile.dirty && !compress(tile))
+            return false;
+    }
+    return true;
+}
+
+size_t compressed_storage::compressed_size() const {
+    return _packed_bytes;
+}
+
+template<typename Op>
+bool compressed_storage::for_each_piece(int x, int y, size_t count, Op op) const {
+    if(x < 0 || y < 0 || y >= _dims.height || (size_t)x + count > (size_t)_dims.width)
+        return false;
+    
+    const size_t tile_row = (size_t)(y / _tile) * _columns;
+    const size_t row_in_tile = (size_t)(y % _tile);
+    
+    size_t done = 0;
+    while(done < count) {
+        const size_t px = (size_t)x + done;
+        const size_t column = px / _tile;
+        const size_t in_tile = px % _tile;
+        const size_t pixels = (std::min)(count - done, (size_t)_tile - in_tile);
+        
+        if(!op(tile_row + column,
+               (row_in_tile * _tile + in_tile) * _bpp,
+               done * _bpp,
+               pixels * _bpp))
+            return false;
+        
+        done += pixels;
+    }
+    return true;
+}
+
+template<typename Op>
+bool compressed_storage::access(size_t index, Op op) const {
+    size_t victim = 0;
+    bool has_victim = false;
+    {
+        auto& tile = _slots[index];
+        std::lock_guard<std::mutex> lock(tile.guard);
+        if(tile.pixels.empty() && !load(tile))
+            return false;
+        
+        op(tile);
+        has_victim = touch(index, victim);
+    }
+    
+    // The tile is unlocked first, so two threads never wait for the tiles of each other
+    return !has_victim || evict(victim);
+}
+
+bool compressed_storage::load(tile_slot& tile) const {
+    if(!charge(_account, _tile_bytes))
+        return false;
+    
+    tile.pixels.resize(_tile_bytes);
+    tile.dirty = false;
+    ++_cached_tiles;
+    
+    if(tile.packed.empty()) {
+        std::memset(tile.pixels.data(), 0, _tile_bytes);
+        return true;
+    }
+    
+    if(!lz_decompress(tile.packed.data(), tile.packed.size(), tile.pixels.data(), _tile_bytes)) {
+        std::vector<unsigned char>().swap(tile.pixels);
+        --_cached_tiles;
+        uncharge(_account, _tile_bytes);
+        return false;
+    }
+    
+    return true;
+}
+
+bool compressed_storage::touch(size_t index, size_t& victim) const {
+    std::lock_guard<std::mutex> lock(_lru_guard);
+    
+    auto& tile = _slots[index];
+    if(tile.in_lru) {
+        _lru.splice(_lru.begin(), _lru, tile.lru_pos);
+    }
+    else {
+        _lru.push_front(index);
+        tile.lru_pos = _lru.begin();
+        tile.in_lru = true;
+    }
+    
+    if(_lru.size() <= _cache_tiles)
+        return false;
+    
+    // The least recently used tile leaves the list at once, so no other thread selects it
+    victim = _lru.back();
+    _slots[victim].in_lru = false;
+    _lru.pop_back();
+    return true;
+}
+
+bool compressed_storage::evict(size_t index) const {
+    auto& tile = _slots[index];
+    std::lock_guard<std::mutex> lock(tile.guard);
+    {
+        // The tile used again after it was selected stays cached
+        std::lock_guard<std::mutex> lru_lock(_lru_guard);
+        if(tile.in_lru || tile.pixels.empty())
+            return true;
+    }
+    
+    if(tile.dirty && !compress(tile)) {
+        // The tile stays cached to be flushed later
+        std::lock_guard<std::mutex> lru_lock(_lru_guard);
+        _lru.push_back(index);
+        tile.lru_pos = std::prev(_lru.end());
+        tile.in_lru = true;
+        return false;
+    }
+    
+    std::vector<unsigned char>().swap(tile.pixels);
+    --_cached_tiles;
+    uncharge(_account, _tile_bytes);
+    return true;
+}
+
+bool compressed_storage::compress(tile_slot& tile) const {
+    std::vector<unsigned char> packed(lz_compress_bound(_tile_bytes));
+    size_t bytes = lz_compress(tile.pixels.data(), _tile_bytes, packed.data(), packed.size());
+    if(!bytes)
+        return false;
+    
+    const size_t prev = tile.packed.size();
+    if(bytes > prev && !charge(_account, bytes - prev))
+        return false;
+    if(bytes < prev)
+        uncharge(_account, prev - bytes);
+    
+    _packed_bytes += bytes;
+    _packed_bytes -= prev;
+    
+    packed.resize(bytes);
+    packed.shrink_to_fit();
+    tile.packed.swap(packed);
+    tile.dirty = false;
+    return true;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "forwards.hpp"
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace atlas2d {
+    
+    namespace details {
+        
+        class compressed_storage;
+        using compressed_storage_ptr = std::shared_ptr<compressed_storage>;
+        
+        /// Pixels split into square tiles compressed one by one. Tiles are decompressed on demand
+        /// to a small LRU cache, modified tiles are compressed back on eviction or flush().
+        /// Tiles never written read as zeros. Thread safe, every tile is locked by itself,
+        /// so threads working on different tiles don't wait for each other.
+        class compressed_storage {
+        public:
+            /// Creates the storage of <dims> pixels. Compressed tiles and the cache are charged to the <account>.
+            /// Returns nullptr if the parameters are invalid.
+            static compressed_storage_ptr create(size dims,
+                                                 size_t bpp,
+                                                 int tile_size,
+                                                 size_t cache_tiles,
+                                                 memory_account_ptr account);
+            
+            ~compressed_storage();
+            
+            compressed_storage(compressed_storage const&) = delete;
+            compressed_storage& operator=(compressed_storage const&) = delete;
+            
+            /// Reads <count> pixels of the row <y> from <x>. Returns false if the memory budget is exceeded.
+            bool read(int x, int y, unsigned char* dst, size_t count) const;
+            
+            /// Writes <count> pixels to the row <y> from <x>. Returns false if the memory budget is exceeded.
+            bool write(int x, int y, unsigned char const* src, size_t count);
+            
+            /// Grows the cache to hold all of the tiles a row of <count> pixels spans,
+            /// so such rows don't evict their own tiles. Every call must be paired with release_row().
+            void fit_row(size_t count);
+            
+            /// Ends the fit_row() call. The last one running restores the configured cache size
+            /// and evicts the tiles beyond it, the ones failing to compress stay cached for flush().
+            void release_row();
+            
+            /// Compresses the modified tiles of the cache. They stay cached.
+            bool flush();
+            
+            /// Returns the size of the compressed tiles
+            size_t compressed_size() const;
+            
+        private:
+            using lru_list = std::list<size_t>;
+            
+            /// A tile, compressed and decompressed pixels are guarded by its own mutex
+            struct tile_slot {
+                std::mutex guard;
+                std::vector<unsigned char> packed;  ///< Empty if the tile was never written
+                std::vector<unsigned char> pixels;  ///< Empty if the tile isn't cached
+                bool dirty = false;
+                bool in_lru = false;                ///< Guarded by the mutex of the LRU list
+                lru_list::iterator lru_pos;
+            };
+            
+            compressed_storage(): _packed_bytes(0), _cached_tiles(0) { ;; }
+            
+            /// Calls <op> with the pixels of the locked tile, decompresses the tile first if needed.
+            /// Evicts the tiles beyond the cache size then.
+            template<typename Op>
+            bool access(size_t index, Op op) const;
+            
+            /// Makes the tile cached, the tile is locked. Returns false if it can't be decompressed.
+            bool load(tile_slot& tile) const;
+            
+            /// Compresses the locked tile to its slot
+            bool compress(tile_slot& tile) const;
+            
+            /// Marks the tile the most recently used one, returns a tile to be evicted if the cache is over
+            bool touch(size_t index, size_t& victim) const;
+            
+            /// Compresses and releases the tile, unless it has been used since it was selected
+            bool evict(size_t index) const;
+            
+            /// Calls <op> for every piece of the row within the tiles, stops if it returns false
+            template<typename Op>
+            bool for_each_piece(int x, int y, size_t count, Op op) const;
+            
+            size _dims = size(0, 0);
+            size_t _bpp = 0;
+            int _tile = 0;
+            int _columns = 0;
+            size_t _tile_bytes = 0;
+            memory_account_ptr _account;
+            
+            std::unique_ptr<tile_slot[]> _slots;
+            size_t _slots_count = 0;
+            mutable std::atomic<size_t> _packed_bytes;
+            mutable std::atomic<size_t> _cached_tiles;                  ///< Tiles having the pixels allocated
+            
+            mutable std::mutex _lru_guard;
+            mutable lru_list _lru;                                      ///< The most recently used tile is the first
+            mutable size_t _cache_tiles = 0;
+            size_t _configured_tiles = 0;                               ///< The cache size given to create()
+            size_t _fitting_rows = 0;                                   ///< fit_row() calls not released yet
+        };
+        
+    } // namespace details
+    
+} // namespace atlas2d
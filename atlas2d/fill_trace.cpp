@@ -0,0 +1,388 @@
+#include "fill_trace.hpp"
+#include "raw_image.hpp"
+#include "palette.hpp"
+#include "parallel.hpp"
+#include "serialization.hpp"
+
+#include <fstream>
+#include <chrono>
+#include <vector>
+#include <tuple>
+#include <algorithm>
+
+using namespace ::atlas2d;
+using namespace ::std;
+using details::put;
+using details::get;
+
+namespace {
+    
+    const char trace_magic[4] = {'A', '2', 'T', 'R'};
+    const uint16_t trace_version = 3;
+    
+    enum record_tag: unsigned char {
+        tag_page = 'P',
+        tag_fill = 'F',
+    };
+    
+    enum fill_flags: unsigned char {
+        flag_premultiple = 1 << 0,
+        flag_dithering = 1 << 1,
+        flag_succeeded = 1 << 2,
+    };
+    
+    /// A page of the trace
+    struct page_record {
+        uint32_t id = 0;
+        int32_t width = 0;
+        int32_t height = 0;
+        uint8_t format = 0;
+        int32_t padding = 0;
+        uint8_t storage = 0;
+        uint8_t layout = 0;
+        int32_t tile_size = 0;
+        uint16_t palette_size = 0;
+        uint8_t wipe_data = 0;
+        uint32_t cache_tiles = 0;
+        int32_t window_top = 0;
+        int32_t window_rows = 0;
+    };
+    
+    /// A call of the trace
+    struct fill_record {
+        uint32_t page = 0;
+        int32_t width = 0;          ///< Source dimensions before the rotation
+        int32_t height = 0;
+        uint8_t format = 0;
+        uint8_t rotation = 0;
+        int32_t x = 0;
+        int32_t y = 0;
+        uint8_t flags = 0;
+        uint64_t elapsed_ns = 0;
+        uint16_t palette_size = 0;
+        int8_t target_channel = -1;
+        uint8_t source_channel = 3;
+        int32_t clip_top = 0;
+        int32_t clip_bottom = 0;
+        int32_t window_top = 0;     ///< Window of the band storage at the time of the call
+    };
+    
+    bool read_page(istream& in, page_record& r) {
+        return get(in, r.id) && get(in, r.width) && get(in, r.height) && get(in, r.format)
+            && get(in, r.padding) && get(in, r.storage) && get(in, r.layout) && get(in, r.tile_size)
+            && get(in, r.palette_size) && get(in, r.wipe_data)
+            && get(in, r.cache_tiles) && get(in, r.window_top) && get(in, r.window_rows);
+    }
+    
+    bool read_fill(istream& in, fill_record& r) {
+        return get(in, r.page) && get(in, r.width) && get(in, r.height) && get(in, r.format)
+            && get(in, r.rotation) && get(in, r.x) && get(in, r.y) && get(in, r.flags)
+            && get(in, r.elapsed_ns) && get(in, r.palette_size)
+            && get(in, r.target_channel) && get(in, r.source_channel)
+            && get(in, r.clip_top) && get(in, r.clip_bottom) && get(in, r.window_top);
+    }
+    
+    uint16_t palette_size_of(palette_ptr const& palette) {
+        return palette ? (uint16_t)palette->colors.size() : 0;
+    }
+    
+    /// Deterministic pseudo-random pixels
+    void fill_synthetic(unsigned char* data, size_t bytes, uint32_t seed) {
+        uint32_t state = seed * 2654435761u + 1;
+        for(size_t i = 0; i < bytes; ++i) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            data[i] = (unsigned char)state;
+        }
+    }
+    
+    palette_ptr synthetic_palette(uint16_t colors) {
+        if(!colors)
+            return nullptr;
+        
+        auto palette = make_shared<pixel_palette>();
+        palette->colors.resize(colors);
+        fill_synthetic((unsigned char*)palette->colors.data(), colors * sizeof(uint32_t), colors);
+        return palette;
+    }
+    
+    /// Synthetic pixels shared by the sources of the same dimensions and format
+    struct synthetic_source {
+        raw_data_ptr data;
+        palette_ptr palette;
+    };
+    
+    /// Rows and columns of the page a call writes to, the mirrored padding included
+    struct call_rect {
+        uint32_t page;
+        int left, top, right, bottom;
+        
+        bool overlaps(call_rect const& r) const {
+            return page == r.page && left < r.right && r.left < right && top < r.bottom && r.top < bottom;
+        }
+    };
+    
+    call_rect rect_of(fill_record const& r, page_record const& page) {
+        // Dimensions are recorded before the rotation
+        bool is_rotated = (r.rotation & 1) != 0;
+        int width = is_rotated ? r.height : r.width;
+        int height = is_rotated ? r.width : r.height;
+        int padding = (std::max)(page.padding, 0);
+        return call_rect{r.page, r.x - padding, r.y - padding, r.x + width + padding, r.y + height + padding};
+    }
+    
+    /// Source pixels must be indices of the palette for p8
+    void clamp_indices(unsigned char* data, size_t bytes, uint16_t palette_size) {
+        for(size_t i = 0; palette_size && i < bytes; ++i)
+            data[i] = (unsigned char)(data[i] % palette_size);
+    }
+    
+} // namespace
+
+
+fill_recorder::fill_recorder(shared_ptr<ostream> out): _out(move(out)) {
+    if(_out) {
+        _out->write(trace_magic, sizeof(trace_magic));
+        put(*_out, trace_version);
+    }
+}
+
+fill_recorder_ptr fill_recorder::open(string const& path) {
+    auto file = make_shared<ofstream>(path.c_str(), ios::binary | ios::trunc);
+    if(!file->is_open())
+        return nullptr;
+    
+    return make_shared<fill_recorder>(file);
+}
+
+bool fill_recorder::good() const {
+    lock_guard<mutex> lock(_guard);
+    return _out && _out->good();
+}
+
+void fill_recorder::flush() {
+    lock_guard<mutex> lock(_guard);
+    if(_out)
+        _out->flush();
+}
+
+uint32_t fill_recorder::page_id(raw_image const& page) {
+    // A re-initialized page, or a new one at the address of a destroyed page, is described anew
+    auto found = _pages.find(page.get_generation());
+    if(found != _pages.end())
+        return found->second;
+    
+    uint32_t id = (uint32_t)_pages.size();
+    _pages[page.get_generation()] = id;
+    
+    auto const& props = page.props();
+    auto& out = *_out;
+    put(out, (uint8_t)tag_page);
+    put(out, id);
+    put(out, (int32_t)props.dimensions.width);
+    put(out, (int32_t)props.dimensions.height);
+    put(out, (uint8_t)props.format);
+    put(out, (int32_t)props.padding_between_sprites);
+    put(out, (uint8_t)props.storage);
+    put(out, (uint8_t)props.layout);
+    put(out, (int32_t)props.tile_size);
+    put(out, palette_size_of(props.palette));
+    put(out, (uint8_t)(props.wipe_data ? 1 : 0));
+    put(out, (uint32_t)(std::min)(props.cache_tiles, (size_t)UINT32_MAX));
+    put(out, (int32_t)props.window_top);
+    put(out, (int32_t)props.window_rows);
+    
+    return id;
+}
+
+void fill_recorder::record(raw_image const& page,
+                           raw_pixel_area const& src,
+                           raw_image_filling_props const& props,
+                           bool result,
+                           uint64_t elapsed_ns)
+{
+    lock_guard<mutex> lock(_guard);
+    if(!_out)
+        return;
+    
+    uint32_t id = page_id(page);
+    
+    // Dimensions are recorded before the rotation
+    auto rotation = src.get_rotation();
+    auto dims = src.get_dimensions();
+    if(rotation == raw_pixel_area::rotate_90_degree || rotation == raw_pixel_area::rotate_270_degree)
+        swap(dims.width, dims.height);
+    
+    uint8_t flags = (props.premultiple ? flag_premultiple : 0)
+                  | (props.dithering ? flag_dithering : 0)
+                  | (result ? flag_succeeded : 0);
+    
+    auto& out = *_out;
+    put(out, (uint8_t)tag_fill);
+    put(out, id);
+    put(out, (int32_t)dims.width);
+    put(out, (int32_t)dims.height);
+    put(out, (uint8_t)src.get_pixel_format());
+    put(out, (uint8_t)rotation);
+    put(out, (int32_t)props.offset_pos.x);
+    put(out, (int32_t)props.offset_pos.y);
+    put(out, flags);
+    put(out, elapsed_ns);
+    put(out, palette_size_of(src.props().palette));
+    put(out, (int8_t)props.target_channel);
+    put(out, (uint8_t)props.source_channel);
+    put(out, (int32_t)props.clip_top);
+    put(out, (int32_t)props.clip_bottom);
+    put(out, (int32_t)page.props().window_top);
+}
+
+bool atlas2d::replay_fill_trace(istream& in, replay_params const& params, replay_stats& stats) {
+    stats = replay_stats();
+    
+    char magic[sizeof(trace_magic)];
+    uint16_t version = 0;
+    if(!in.read(magic, sizeof(magic)) || !equal(magic, magic + sizeof(magic), trace_magic))
+        return false;
+    if(!get(in, version) || version != trace_version)
+        return false;
+    
+    vector<page_record> pages;
+    vector<fill_record> calls;
+    
+    unsigned char tag = 0;
+    while(get(in, tag)) {
+        if(tag == tag_page) {
+            page_record r;
+            if(!read_page(in, r) || r.id != pages.size())
+                return false;
+            pages.push_back(r);
+        }
+        else if(tag == tag_fill) {
+            fill_record r;
+            if(!read_fill(in, r) || r.page >= pages.size())
+                return false;
+            calls.push_back(r);
+        }
+        else {
+            return false;
+        }
+    }
+    
+    // Set up the pages
+    vector<shared_ptr<raw_image>> images;
+    for(auto const& r : pages) {
+        auto image = make_shared<raw_image>();
+        image->init(raw_image::init_props()
+                    .set_dims(size(r.width, r.height))
+                    .set_pixel_format((pixel_format)r.format)
+                    .set_sprites_padding(r.padding)
+                    .wipe_allocated_data(r.wipe_data != 0)
+                    .set_cache_tiles(r.cache_tiles)
+                    .set_window(r.window_top, r.window_rows)
+                    .set_storage((raw_storage)r.storage)
+                    .set_layout((pixel_layout)r.layout, r.tile_size)
+                    .set_palette(synthetic_palette(r.palette_size)));
+        images.push_back(image);
+    }
+    
+    // Set up the sources, the same dimensions and format share the pixels
+    using source_key = tuple<int32_t, int32_t, uint8_t, uint16_t>;
+    map<source_key, synthetic_source> cache;
+    vector<shared_ptr<raw_pixel_area>> sources;
+    
+    for(auto const& r : calls) {
+        auto key = make_tuple(r.width, r.height, r.format, r.palette_size);
+        auto& src = cache[key];
+        if(!src.data) {
+            size_t bytes = (size_t)(std::max)(r.width, 0) * (size_t)(std::max)(r.height, 0)
+                         * (size_t)pixel_format_details((pixel_format)r.format).bpp;
+            src.data = raw_data_ptr(new unsigned char[bytes ? bytes : 1], default_delete<unsigned char[]>());
+            fill_synthetic(src.data.get(), bytes, (uint32_t)cache.size());
+            if((pixel_format)r.format == pixel_format::p8)
+                clamp_indices(src.data.get(), bytes, r.palette_size);
+            src.palette = synthetic_palette(r.palette_size);
+        }
+        
+        auto area = make_shared<raw_pixel_area>();
+        area->init(raw_pixel_area::init_props()
+                   .set_dims(size(r.width, r.height))
+                   .set_pixel_format((pixel_format)r.format)
+                   .set_raw_data(src.data)
+                   .set_palette(src.palette));
+        area->set_rotator((raw_pixel_area::rotation)(r.rotation & 3));
+        sources.push_back(area);
+        
+        stats.recorded_seconds += (double)r.elapsed_ns * 1e-9;
+        stats.pixels += (uint64_t)(std::max)(r.width, 0) * (uint64_t)(std::max)(r.height, 0);
+    }
+    
+    // The calls of a segment run in parallel, so a segment ends before a call moving a band window
+    // or overlapping a call of the segment (the layers of packed channels do so), and such calls
+    // keep their recorded order. The windows are moved between the segments.
+    vector<size_t> segments;
+    vector<int32_t> windows(pages.size());
+    vector<call_rect> segment_rects;
+    for(size_t i = 0; i < pages.size(); ++i)
+        windows[i] = pages[i].window_top;
+    for(size_t i = 0; i < calls.size(); ++i) {
+        auto const& r = calls[i];
+        auto rect = rect_of(r, pages[r.page]);
+        
+        bool moves_window = (raw_storage)pages[r.page].storage == raw_storage::band && windows[r.page] != r.window_top;
+        bool overlaps = any_of(segment_rects.begin(), segment_rects.end(), [&](call_rect const& other){
+            return rect.overlaps(other);
+        });
+        
+        if(moves_window || overlaps) {
+            windows[r.page] = r.window_top;
+            segments.push_back(i);
+            segment_rects.clear();
+        }
+        segment_rects.push_back(rect);
+    }
+    segments.push_back(calls.size());
+    
+    vector<size_t> failed(details::workers_count_for(calls.size(), params.threads), 0);
+    
+    auto started = chrono::steady_clock::now();
+    for(int repeat = 0; repeat < params.repeats; ++repeat) {
+        size_t begin = 0;
+        for(auto end : segments) {
+            for(size_t i = begin; i < end; ++i) {
+                auto const& r = calls[i];
+                auto& image = *images[r.page];
+                if(image.props().storage == raw_storage::band && image.props().window_top != r.window_top)
+                    image.move_window(r.window_top);
+            }
+            
+            details::parallel_for(end - begin, [&](size_t first, size_t last, size_t worker){
+                for(size_t i = begin + first; i < begin + last; ++i) {
+                    auto const& r = calls[i];
+                    bool ok = images[r.page]->fill_image(*sources[i], raw_image::filling_props()
+                                                         .set_offset(offset(r.x, r.y))
+                                                         .enable_premultiple((r.flags & flag_premultiple) != 0)
+                                                         .enable_dithering((r.flags & flag_dithering) != 0)
+                                                         .pack_to_channel(r.target_channel, r.source_channel)
+                                                         .clip_rows(r.clip_top, r.clip_bottom));
+                    if(!ok)
+                        ++failed[worker];
+                }
+            }, failed.size());
+            
+            begin = end;
+        }
+    }
+    auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    
+    const int repeats = (std::max)(params.repeats, 0);
+    stats.pages = pages.size();
+    stats.calls = calls.size() * repeats;
+    stats.pixels *= repeats;
+    for(auto f : failed)
+        stats.failed += f;
+    stats.seconds = elapsed;
+    stats.megapixels_per_second = elapsed > 0 ? (double)stats.pixels / elapsed * 1e-6 : 0;
+    
+    return true;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "forwards.hpp"
+#include "pixel_format.hpp"
+
+#include <cstdint>
+#include <iosfwd>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace atlas2d {
+    
+    class raw_image;
+    class raw_pixel_area;
+    struct raw_image_filling_props;
+    
+    class fill_recorder;
+    using fill_recorder_ptr = std::shared_ptr<fill_recorder>;
+    
+    /// Writes the parameters of raw_image::fill_image calls to a compact binary trace.
+    /// Pixels are not recorded, only dimensions, formats and the filling properties.
+    class fill_recorder {
+    public:
+        /// Records to the stream, which must stay alive while the recorder is in use
+        explicit fill_recorder(std::shared_ptr<std::ostream> out);
+        
+        /// Creates a recorder writing to the file. Returns nullptr if the file can't be created.
+        static fill_recorder_ptr open(std::string const& path);
+        
+        /// Records a call. Thread safe.
+        void record(raw_image const& page,
+                    raw_pixel_area const& src,
+                    raw_image_filling_props const& props,
+                    bool result,
+                    uint64_t elapsed_ns);
+        
+        /// Returns false if writing failed
+        bool good() const;
+        
+        /// Flushes the stream
+        void flush();
+        
+    private:
+        uint32_t page_id(raw_image const& page);
+        
+        std::shared_ptr<std::ostream> _out;
+        std::map<uint64_t, uint32_t> _pages;    ///< Generations of the pages to their ids
+        mutable std::mutex _guard;
+    };
+    
+    /// A set of parameters of replaying a trace
+    struct replay_params {
+        size_t threads = 1;     ///< Workers count, calls are distributed between them
+        int repeats = 1;        ///< How many times the whole trace is replayed
+    };
+    
+    // Helper
+    struct set_replay_params: replay_params {
+        using self = set_replay_params;
+        self& set_threads(size_t arg) {threads=arg; return *this;}
+        self& set_repeats(int arg) {repeats=arg; return *this;}
+    };
+    
+    /// Results of replaying
+    struct replay_stats {
+        size_t pages = 0;               ///< Count of pages in the trace
+        size_t calls = 0;               ///< Count of replayed calls
+        size_t failed = 0;              ///< Calls which returned false while replaying
+        uint64_t pixels = 0;            ///< Count of source pixels filled
+        double seconds = 0;             ///< Wall time of the replay
+        double recorded_seconds = 0;    ///< Time the calls took when they were recorded
+        double megapixels_per_second = 0;
+    };
+    
+    /// Reads the trace and re-runs the calls against synthetic pixel data.
+    /// Calls run in parallel until one overlaps a call already running (padding included)
+    /// or moves the window of a band, so the overlapping calls and the layers of packed
+    /// channels are replayed in the recorded order. Returns false if the trace is malformed.
+    bool replay_fill_trace(std::istream& in, replay_params const& params, replay_stats& stats);
+    
+} // namespace atlas2d
@@ -31,7 +31,12 @@ namespace atlas2d {
 
     enum class pixel_format;
     struct format_info;
+    struct pixel_palette;
     class pixels_array;
     class image;
+    class memory_account;
+    
+    using palette_ptr = std::shared_ptr<pixel_palette const>;
+    using memory_account_ptr = std::shared_ptr<memory_account>;
 
 } // namespace atlas2d
@@ -0,0 +1,169 @@
+#include "half_float.hpp"
+
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define ATLAS2D_HAS_F16C_DISPATCH 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define ATLAS2D_HAS_NEON_F16 1
+#include <arm_neon.h>
+#endif
+
+using namespace ::atlas2d;
+using namespace ::atlas2d::details;
+
+uint16_t details::float_to_half(float value) {
+    uint32_t f;
+    std::memcpy(&f, &value, sizeof(f));
+    
+    const uint32_t sign = (f >> 16) & 0x8000;
+    const uint32_t abs = f & 0x7FFFFFFF;
+    
+    if(abs >= 0x7F800000) {
+        // Inf or NaN, NaN keeps a payload bit
+        return (uint16_t)(sign | 0x7C00 | (abs > 0x7F800000 ? 0x200 : 0));
+    }
+    
+    if(abs >= 0x477FF000) {
+        // Overflows to infinity
+        return (uint16_t)(sign | 0x7C00);
+    }
+    
+    if(abs < 0x38800000) {
+        // Subnormal half or zero
+        if(abs < 0x33000000)
+            return (uint16_t)sign;
+        
+        const uint32_t exponent = abs >> 23;
+        const uint32_t mantissa = (abs & 0x007FFFFF) | 0x00800000;
+        const uint32_t shift = 126 - exponent;
+        uint32_t half = mantissa >> shift;
+        
+        // Round to the nearest even
+        const uint32_t rest = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if(rest > halfway || (rest == halfway && (half & 1)))
+            ++half;
+        
+        return (uint16_t)(sign | half);
+    }
+    
+    // Normal number: rebias the exponent and round the mantissa to the nearest even
+    uint32_t half = ((abs - 0x38000000) >> 13);
+    const uint32_t rest = abs & 0x1FFF;
+    if(rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        ++half;
+    
+    return (uint16_t)(sign | half);
+}
+
+float details::half_to_float(uint16_t value) {
+    const uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+    uint32_t exponent = (value >> 10) & 0x1F;
+    uint32_t mantissa = value & 0x3FF;
+    uint32_t f;
+    
+    if(exponent == 0x1F) {
+        f = sign | 0x7F800000 | (mantissa << 13);
+    }
+    else if(exponent) {
+        f = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    else if(mantissa) {
+        // Normalize the subnormal
+        exponent = 113;
+        while(!(mantissa & 0x400)) {
+            mantissa <<= 1;
+            --exponent;
+        }
+        f = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+    }
+    else {
+        f = sign;
+    }
+    
+    float result;
+    std::memcpy(&result, &f, sizeof(result));
+    return result;
+}
+
+namespace {
+    
+    void floats_to_halves_scalar(float const* src, uint16_t* dst, size_t count) {
+        for(size_t i = 0; i < count; ++i)
+            dst[i] = float_to_half(src[i]);
+    }
+    
+    void halves_to_floats_scalar(uint16_t const* src, float* dst, size_t count) {
+        for(size_t i = 0; i < count; ++i)
+            dst[i] = half_to_float(src[i]);
+    }
+    
+#if defined(ATLAS2D_HAS_F16C_DISPATCH)
+    
+    __attribute__((target("f16c")))
+    void floats_to_halves_f16c(float const* src, uint16_t* dst, size_t count) {
+        size_t i = 0;
+        for(; i + 8 <= count; i += 8) {
+            __m128i lo = _mm_cvtps_ph(_mm_loadu_ps(&src[i]), _MM_FROUND_TO_NEAREST_INT);
+            __m128i hi = _mm_cvtps_ph(_mm_loadu_ps(&src[i + 4]), _MM_FROUND_TO_NEAREST_INT);
+            _mm_storeu_si128((__m128i*)&dst[i], _mm_unpacklo_epi64(lo, hi));
+        }
+        floats_to_halves_scalar(&src[i], &dst[i], count - i);
+    }
+    
+    __attribute__((target("f16c")))
+    void halves_to_floats_f16c(uint16_t const* src, float* dst, size_t count) {
+        size_t i = 0;
+        for(; i + 8 <= count; i += 8) {
+            __m128i h = _mm_loadu_si128((__m128i const*)&src[i]);
+            _mm_storeu_ps(&dst[i], _mm_cvtph_ps(h));
+            _mm_storeu_ps(&dst[i + 4], _mm_cvtph_ps(_mm_unpackhi_epi64(h, h)));
+        }
+        halves_to_floats_scalar(&src[i], &dst[i], count - i);
+    }
+    
+    bool cpu_has_f16c() {
+        static const bool has = __builtin_cpu_supports("f16c") != 0;
+        return has;
+    }
+    
+#endif
+    
+} // namespace
+
+
+void details::floats_to_halves(float const* src, uint16_t* dst, size_t count) {
+#if defined(ATLAS2D_HAS_F16C_DISPATCH)
+    if(cpu_has_f16c()) {
+        floats_to_halves_f16c(src, dst, count);
+        return;
+    }
+#elif defined(ATLAS2D_HAS_NEON_F16)
+    size_t i = 0;
+    for(; i + 4 <= count; i += 4)
+        vst1_u16(&dst[i], vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(&src[i]))));
+    src += i;
+    dst += i;
+    count -= i;
+#endif
+    floats_to_halves_scalar(src, dst, count);
+}
+
+void details::halves_to_floats(uint16_t const* src, float* dst, size_t count) {
+#if defined(ATLAS2D_HAS_F16C_DISPATCH)
+    if(cpu_has_f16c()) {
+        halves_to_floats_f16c(src, dst, count);
+        return;
+    }
+#elif defined(ATLAS2D_HAS_NEON_F16)
+    size_t i = 0;
+    for(; i + 4 <= count; i += 4)
+        vst1q_f32(&dst[i], vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(&src[i]))));
+    src += i;
+    dst += i;
+    count -= i;
+#endif
+    halves_to_floats_scalar(src, dst, count);
+}
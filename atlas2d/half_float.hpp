@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace atlas2d {
+    
+    namespace details {
+        
+        /// Converts a float to IEEE 754 half precision, rounds to the nearest even
+        uint16_t float_to_half(float value);
+        
+        /// Converts IEEE 754 half precision to a float
+        float half_to_float(uint16_t value);
+        
+        /// Converts <count> floats. Uses F16C (x86) or NEON (arm64) when the CPU has it.
+        void floats_to_halves(float const* src, uint16_t* dst, size_t count);
+        
+        /// Converts <count> halves. Uses F16C (x86) or NEON (arm64) when the CPU has it.
+        void halves_to_floats(uint16_t const* src, float* dst, size_t count);
+        
+    } // namespace details
+    
+} // namespace atlas2d
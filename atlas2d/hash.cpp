@@ -0,0 +1,103 @@
+#include "hash.hpp"
+
+#include <cstring>
+
+using namespace ::atlas2d;
+using namespace ::atlas2d::details;
+
+namespace {
+    
+    const uint64_t prime1 = 0x9E3779B185EBCA87ull;
+    const uint64_t prime2 = 0xC2B2AE3D27D4EB4Full;
+    const uint64_t prime3 = 0x165667B19E3779F9ull;
+    const uint64_t prime4 = 0x85EBCA77C2B2AE63ull;
+    const uint64_t prime5 = 0x27D4EB2F165667C5ull;
+    
+    inline uint64_t rotl(uint64_t v, int bits) {
+        return (v << bits) | (v >> (64 - bits));
+    }
+    
+    // Little-endian reads, so the hash doesn't depend on the platform
+    
+    inline uint64_t read64(unsigned char const* p) {
+        uint64_t v = 0;
+        for(int i = 0; i < 8; ++i)
+            v |= (uint64_t)p[i] << (i * 8);
+        return v;
+    }
+    
+    inline uint32_t read32(unsigned char const* p) {
+        return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+    
+    inline uint64_t round(uint64_t acc, uint64_t input) {
+        acc += input * prime2;
+        acc = rotl(acc, 31);
+        return acc * prime1;
+    }
+    
+    inline uint64_t merge_round(uint64_t acc, uint64_t value) {
+        acc ^= round(0, value);
+        return acc * prime1 + prime4;
+    }
+    
+} // namespace
+
+
+uint64_t details::hash64(void const* data, size_t bytes, uint64_t seed) {
+    unsigned char const* p = (unsigned char const*)data;
+    unsigned char const* const end = p + bytes;
+    uint64_t h;
+    
+    if(bytes >= 32) {
+        uint64_t v1 = seed + prime1 + prime2;
+        uint64_t v2 = seed + prime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - prime1;
+        
+        // Four independent lanes of 8 bytes
+        unsigned char const* const limit = end - 32;
+        do {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+            p += 32;
+        } while(p <= limit);
+        
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge_round(h, v1);
+        h = merge_round(h, v2);
+        h = merge_round(h, v3);
+        h = merge_round(h, v4);
+    }
+    else {
+        h = seed + prime5;
+    }
+    
+    h += (uint64_t)bytes;
+    
+    for(; p + 8 <= end; p += 8) {
+        h ^= round(0, read64(p));
+        h = rotl(h, 27) * prime1 + prime4;
+    }
+    
+    if(p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * prime1;
+        h = rotl(h, 23) * prime2 + prime3;
+        p += 4;
+    }
+    
+    for(; p < end; ++p) {
+        h ^= (*p) * prime5;
+        h = rotl(h, 11) * prime1;
+    }
+    
+    // Avalanche
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace atlas2d {
+    
+    namespace details {
+        
+        /// Fast non-cryptographic 64-bit hash (the XXH64 algorithm), stable across platforms
+        uint64_t hash64(void const* data, size_t bytes, uint64_t seed = 0);
+        
+    } // namespace details
+    
+} // namespace atlas2d
@@ -0,0 +1,173 @@
+#include "lz_codec.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+using namespace ::atlas2d;
+using namespace ::atlas2d::details;
+
+namespace {
+    
+    const size_t min_match = 4;
+    const size_t last_literals = 5;     ///< The block always ends by literals
+    const size_t match_limit = 12;      ///< No match starts closer to the end
+    const size_t max_distance = 65535;
+    const int hash_bits = 12;
+    
+    inline uint32_t read32(unsigned char const* p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    
+    inline uint32_t hash_of(uint32_t sequence) {
+        return (sequence * 2654435761u) >> (32 - hash_bits);
+    }
+    
+    /// Writes the remainder of a length above 15 as a run of 255s
+    inline unsigned char* put_length(unsigned char* op, size_t length) {
+        for(; length >= 255; length -= 255)
+            *op++ = 255;
+        *op++ = (unsigned char)length;
+        return op;
+    }
+    
+    /// Reads the remainder of a length. Returns false at the end of the input.
+    inline bool get_length(unsigned char const*& ip, unsigned char const* end, size_t& length) {
+        unsigned char b;
+        do {
+            if(ip >= end)
+                return false;
+            b = *ip++;
+            length += b;
+        } while(b == 255);
+        return true;
+    }
+    
+} // namespace
+
+
+size_t details::lz_compress_bound(size_t bytes) {
+    return bytes + bytes / 255 + 16;
+}
+
+size_t details::lz_compress(unsigned char const* src, size_t bytes, unsigned char* dst, size_t capacity) {
+    if(capacity < lz_compress_bound(bytes))
+        return 0;
+    
+    // Positions are kept plus one, zero means no entry
+    uint32_t table[1 << hash_bits];
+    memset(table, 0, sizeof(table));
+    
+    unsigned char* op = dst;
+    size_t anchor = 0;
+    size_t ip = 0;
+    
+    auto emit = [&](size_t literals_end, size_t distance, size_t match_length) {
+        size_t literals = literals_end - anchor;
+        unsigned char* token = op++;
+        
+        *token = (unsigned char)((literals < 15 ? literals : 15) << 4);
+        if(literals >= 15)
+            op = put_length(op, literals - 15);
+        
+        if(literals)
+            memcpy(op, &src[anchor], literals);
+        op += literals;
+        
+        if(!match_length)
+            return;
+        
+        *op++ = (unsigned char)distance;
+        *op++ = (unsigned char)(distance >> 8);
+        
+        size_t length = match_length - min_match;
+        *token |= (unsigned char)(length < 15 ? length : 15);
+        if(length >= 15)
+            op = put_length(op, length - 15);
+    };
+    
+    if(bytes > match_limit) {
+        const size_t limit = bytes - match_limit;
+        size_t misses = 0;
+        
+        while(ip < limit) {
+            uint32_t sequence = read32(&src[ip]);
+            uint32_t& entry = table[hash_of(sequence)];
+            size_t candidate = entry;
+            entry = (uint32_t)(ip + 1);
+            
+            if(!candidate || ip - (candidate - 1) > max_distance || read32(&src[candidate - 1]) != sequence) {
+                // Incompressible data is skipped faster and faster
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            
+            const size_t ref = candidate - 1;
+            size_t length = min_match;
+            while(ip + length < bytes - last_literals && src[ref + length] == src[ip + length])
+                ++length;
+            
+            emit(ip, ip - ref, length);
+            ip += length;
+            anchor = ip;
+            misses = 0;
+        }
+    }
+    
+    emit(bytes, 0, 0);
+    return (size_t)(op - dst);
+}
+
+bool details::lz_decompress(unsigned char const* src, size_t src_bytes, unsigned char* dst, size_t bytes) {
+    unsigned char const* ip = src;
+    unsigned char const* const end = src + src_bytes;
+    size_t out = 0;
+    
+    while(ip < end) {
+        const unsigned char token = *ip++;
+        
+        size_t literals = token >> 4;
+        if(literals == 15 && !get_length(ip, end, literals))
+            return false;
+        
+        if(literals > (size_t)(end - ip) || literals > bytes - out)
+            return false;
+        
+        memcpy(&dst[out], ip, literals);
+        ip += literals;
+        out += literals;
+        
+        // The last sequence has no match
+        if(ip == end)
+            break;
+        
+        if(end - ip < 2)
+            return false;
+        
+        size_t distance = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        
+        size_t length = token & 15;
+        if(length == 15 && !get_length(ip, end, length))
+            return false;
+        length += min_match;
+        
+        if(!distance || distance > out || length > bytes - out)
+            return false;
+        
+        unsigned char* op = &dst[out];
+        unsigned char const* ref = op - distance;
+        if(distance >= length) {
+            memcpy(op, ref, length);
+        }
+        else {
+            // Overlapping match repeats the pattern
+            for(size_t i = 0; i < length; ++i)
+                op[i] = ref[i];
+        }
+        out += length;
+    }
+    
+    return out == bytes;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+
+namespace atlas2d {
+    
+    namespace details {
+        
+        // A fast LZ77 codec producing the LZ4 block format
+        
+        /// Returns the size of the buffer enough to compress <bytes> in the worst case
+        size_t lz_compress_bound(size_t bytes);
+        
+        /// Compresses <bytes> of <src> to <dst> having <capacity> bytes.
+        /// Returns the compressed size or 0 if it doesn't fit.
+        size_t lz_compress(unsigned char const* src, size_t bytes, unsigned char* dst, size_t capacity);
+        
+        /// Decompresses the block to exactly <bytes> bytes of <dst>. Returns false if the block is malformed.
+        bool lz_decompress(unsigned char const* src, size_t src_bytes, unsigned char* dst, size_t bytes);
+        
+    } // namespace details
+    
+} // namespace atlas2d
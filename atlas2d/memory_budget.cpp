@@ -0,0 +1,148 @@
+#include "memory_budget.hpp"
+
+#include <cstdlib>
+
+using namespace ::atlas2d;
+using namespace ::std;
+
+namespace {
+    
+    /// Counters of the whole library
+    struct global_counters {
+        atomic<size_t> budget;
+        atomic<size_t> current;
+        atomic<size_t> peak;
+        
+        global_counters(): budget(0), current(0), peak(0) { ;; }
+    };
+    
+    global_counters& globals() {
+        static global_counters g;
+        return g;
+    }
+    
+    void update_peak(atomic<size_t>& peak, size_t value) {
+        size_t prev = peak.load(memory_order_relaxed);
+        while(prev < value && !peak.compare_exchange_weak(prev, value, memory_order_relaxed))
+            ;;
+    }
+    
+    /// Adds <bytes> to the <current> unless it goes beyond the <limit>, <total> gets the new value
+    bool try_charge(atomic<size_t>& current, size_t limit, size_t bytes, size_t& total) {
+        size_t prev = current.load(memory_order_relaxed);
+        do {
+            if(limit && (prev + bytes > limit || prev + bytes < prev))
+                return false;
+        } while(!current.compare_exchange_weak(prev, prev + bytes, memory_order_relaxed));
+        
+        total = prev + bytes;
+        return true;
+    }
+    
+    bool acquire_global(size_t bytes) {
+        auto& g = globals();
+        size_t total = 0;
+        if(!try_charge(g.current, g.budget.load(memory_order_relaxed), bytes, total))
+            return false;
+        
+        update_peak(g.peak, total);
+        return true;
+    }
+    
+    void release_global(size_t bytes) {
+        globals().current.fetch_sub(bytes, memory_order_relaxed);
+    }
+    
+} // namespace
+
+
+memory_account::memory_account(memory_account_ptr parent, size_t limit)
+: _parent(move(parent))
+, _limit(limit)
+, _current(0)
+, _peak(0)
+{
+    ;;
+}
+
+memory_account::~memory_account() {
+    ;;
+}
+
+bool memory_account::acquire(size_t bytes) {
+    size_t total = 0;
+    if(!try_charge(_current, _limit, bytes, total))
+        return false;
+    
+    bool charged = _parent ? _parent->acquire(bytes) : acquire_global(bytes);
+    if(!charged) {
+        _current.fetch_sub(bytes, memory_order_relaxed);
+        return false;
+    }
+    
+    // The peak counts the charges accepted by the whole chain only
+    update_peak(_peak, total);
+    return true;
+}
+
+void memory_account::release(size_t bytes) {
+    _current.fetch_sub(bytes, memory_order_relaxed);
+    
+    if(_parent)
+        _parent->release(bytes);
+    else
+        release_global(bytes);
+}
+
+memory_usage memory_account::usage() const {
+    memory_usage u;
+    u.current = _current.load(memory_order_relaxed);
+    u.peak = _peak.load(memory_order_relaxed);
+    return u;
+}
+
+void atlas2d::set_memory_budget(size_t bytes) {
+    globals().budget = bytes;
+}
+
+size_t atlas2d::memory_budget() {
+    return globals().budget;
+}
+
+memory_usage atlas2d::global_memory_usage() {
+    memory_usage u;
+    u.current = globals().current.load(memory_order_relaxed);
+    u.peak = globals().peak.load(memory_order_relaxed);
+    return u;
+}
+
+void atlas2d::reset_memory_peak() {
+    auto& g = globals();
+    g.peak = g.current.load(memory_order_relaxed);
+}
+
+raw_data_ptr details::allocate_tracked(size_t bytes, memory_account_ptr const& account, bool wipe) {
+    if(!bytes)
+        return nullptr;
+    
+    bool charged = account ? account->acquire(bytes) : acquire_global(bytes);
+    if(!charged)
+        return nullptr;
+    
+    auto ptr = (unsigned char*)(wipe ? calloc(bytes, 1) : malloc(bytes));
+    if(!ptr) {
+        if(account)
+            account->release(bytes);
+        else
+            release_global(bytes);
+        return nullptr;
+    }
+    
+    return raw_data_ptr(ptr, [account, bytes](unsigned char* p){
+        free(p);
+        if(account)
+            account->release(bytes);
+        else
+            release_global(bytes);
+    });
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "forwards.hpp"
+
+#include <atomic>
+
+namespace atlas2d {
+    
+    /// Memory usage counters
+    struct memory_usage {
+        size_t current = 0;     ///< Bytes allocated at the moment
+        size_t peak = 0;        ///< The highest value of the <current> so far
+    };
+    
+    /// Accounts the memory allocated for a group of objects, e.g. an image or all of the images of a build.
+    /// Every allocation is also charged to the parent accounts and to the global counters.
+    class memory_account {
+    public:
+        /// <limit> of zero means the account is limited by its parents and the global budget only
+        explicit memory_account(memory_account_ptr parent = nullptr, size_t limit = 0);
+        ~memory_account();
+        
+        memory_account(memory_account const&) = delete;
+        memory_account& operator=(memory_account const&) = delete;
+        
+        /// Charges <bytes> to the account. Returns false and charges nothing if any budget would be exceeded.
+        bool acquire(size_t bytes);
+        
+        /// Returns <bytes> back
+        void release(size_t bytes);
+        
+        /// Returns the counters of the account
+        memory_usage usage() const;
+        
+        /// Returns the limit of the account
+        size_t limit() const { return _limit; }
+        
+        /// Returns the parent account
+        memory_account_ptr const& parent() const { return _parent; }
+        
+    private:
+        memory_account_ptr _parent;
+        size_t _limit;
+        std::atomic<size_t> _current;
+        std::atomic<size_t> _peak;
+    };
+    
+    /// Sets the budget for all of the memory allocated by the library, 0 means no limit
+    void set_memory_budget(size_t bytes);
+    
+    /// Returns the global budget
+    size_t memory_budget();
+    
+    /// Returns the global counters
+    memory_usage global_memory_usage();
+    
+    /// Drops the global peak to the current usage
+    void reset_memory_peak();
+    
+    namespace details {
+        
+        /// Allocates a pixels buffer of <bytes> charged to the <account> (the global counters only if it's null).
+        /// Returns nullptr if the budget would be exceeded or the allocation fails.
+        raw_data_ptr allocate_tracked(size_t bytes, memory_account_ptr const& account, bool wipe = false);
+        
+    } // namespace details
+    
+} // namespace atlas2d
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace atlas2d {
+    
+    namespace details {
+        
+        /// Bounded lock-free queue of many producers and many consumers (D. Vyukov's algorithm).
+        /// Every cell has a sequence number telling whether it is ready to be written or read.
+        template<typename T>
+        class mpmc_queue {
+        public:
+            /// The capacity is rounded up to a power of two
+            explicit mpmc_queue(size_t capacity) {
+                size_t n = 2;
+                while(n < capacity)
+                    n <<= 1;
+                
+                _mask = n - 1;
+                _cells.reset(new cell[n]);
+                for(size_t i = 0; i < n; ++i)
+                    _cells[i].sequence.store(i, std::memory_order_relaxed);
+                
+                _enqueue_pos.store(0, std::memory_order_relaxed);
+                _dequeue_pos.store(0, std::memory_order_relaxed);
+            }
+            
+            mpmc_queue(mpmc_queue const&) = delete;
+            mpmc_queue& operator=(mpmc_queue const&) = delete;
+            
+            /// Returns false if the queue is full
+            bool try_push(T&& value) {
+                size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+                for(;;) {
+                    cell& c = _cells[pos & _mask];
+                    size_t seq = c.sequence.load(std::memory_order_acquire);
+                    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+                    
+                    if(diff == 0) {
+                        if(_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                            c.data = std::move(value);
+                            c.sequence.store(pos + 1, std::memory_order_release);
+                            return true;
+                        }
+                    }
+                    else if(diff < 0) {
+                        return false;
+                    }
+                    else {
+                        pos = _enqueue_pos.load(std::memory_order_relaxed);
+                    }
+                }
+            }
+            
+            /// Returns false if the queue is empty
+            bool try_pop(T& value) {
+                size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+                for(;;) {
+                    cell& c = _cells[pos & _mask];
+                    size_t seq = c.sequence.load(std::memory_order_acquire);
+                    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+                    
+                    if(diff == 0) {
+                        if(_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                            value = std::move(c.data);
+                            c.sequence.store(pos + _mask + 1, std::memory_order_release);
+                            return true;
+                        }
+                    }
+                    else if(diff < 0) {
+                        return false;
+                    }
+                    else {
+                        pos = _dequeue_pos.load(std::memory_order_relaxed);
+                    }
+                }
+            }
+            
+            size_t capacity() const { return _mask + 1; }
+            
+        private:
+            struct cell {
+                std::atomic<size_t> sequence;
+                T data;
+            };
+            
+            std::unique_ptr<cell[]> _cells;
+            size_t _mask = 0;
+            
+            // The positions are kept on separate cache lines
+            alignas(64) std::atomic<size_t> _enqueue_pos;
+            alignas(64) std::atomic<size_t> _dequeue_pos;
+        };
+        
+    } // namespace details
+    
+} // namespace atlas2d
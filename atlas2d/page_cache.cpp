@@ -0,0 +1,343 @@
+#include "page_cache.hpp"
+#include "pixel_format.hpp"
+#include "palette.hpp"
+#include "hash.hpp"
+#include "pixel_layout.hpp"
+#include "serialization.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+using namespace ::atlas2d;
+using namespace ::std;
+using details::put;
+using details::get;
+
+namespace {
+    
+    const char cache_magic[4] = {'A', '2', 'P', 'C'};
+    const uint16_t cache_version = 2;
+    const char* const cache_extension = ".a2page";
+    
+    /// Pixels start at the aligned offset, so the mapped data is aligned too
+    const size_t header_alignment = 64;
+    
+    uint64_t hash_palette(palette_ptr const& palette) {
+        if(!palette || palette->colors.empty())
+            return 0;
+        return details::hash64(palette->colors.data(), palette->colors.size() * sizeof(uint32_t));
+    }
+    
+    /// Header of a cached page. The palette isn't stored, it's a part of the fingerprint.
+    struct page_header {
+        int32_t width = 0;
+        int32_t height = 0;
+        uint8_t format = 0;
+        uint8_t storage = 0;
+        uint8_t layout = 0;
+        int32_t tile_size = 0;
+        uint64_t data_size = 0;
+    };
+    
+    /// Size of the header rounded up to the alignment
+    const size_t header_size = (sizeof(cache_magic) + 2 + 4 + 4 + 1 + 1 + 1 + 4 + 8 + header_alignment - 1)
+                               / header_alignment * header_alignment;
+    
+    /// The pixels buffer is stored as is, in the layout of the page. The compressed storage has no
+    /// such buffer, its rows are stored one after another.
+    bool has_buffer(raw_storage storage) {
+        return storage == raw_storage::heap || storage == raw_storage::sparse;
+    }
+    
+    /// Returns the size of the stored pixels of the page
+    size_t stored_size(raw_image_props const& props) {
+        const int bpp = pixel_format_details(props.format).bpp;
+        if(!has_buffer(props.storage))
+            return (size_t)props.dimensions.width * props.dimensions.height * bpp;
+        
+        details::layout_addressing addressing(props.layout, props.dimensions, bpp, props.tile_size);
+        return addressing.is_valid() ? addressing.data_size() : 0;
+    }
+    
+    /// Maps the file, the mapping is private so writes to the page don't reach the file
+    raw_data_ptr map_file(string const& path, size_t& bytes) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0)
+            return nullptr;
+        
+        struct stat info;
+        void* data = MAP_FAILED;
+        if(::fstat(fd, &info) == 0 && info.st_size > 0) {
+            bytes = (size_t)info.st_size;
+            data = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd);
+        
+        if(data == MAP_FAILED)
+            return nullptr;
+        
+        return raw_data_ptr((unsigned char*)data, [bytes](unsigned char* p){ ::munmap(p, bytes); });
+    }
+    
+    /// A file of the cache directory
+    struct cache_entry {
+        string path;
+        uint64_t bytes;
+        time_t used;
+    };
+    
+} // namespace
+
+
+page_fingerprint::page_fingerprint(raw_image_props const& page): _value(cache_version) {
+    mix((uint64_t)page.format);
+    mix((uint64_t)(uint32_t)page.dimensions.width);
+    mix((uint64_t)(uint32_t)page.dimensions.height);
+    mix((uint64_t)(uint32_t)page.padding_between_sprites);
+    mix(hash_palette(page.palette));
+    
+    // The pixels are cached in the layout of the page, the gaps of a page not wiped hold whatever
+    // the heap had, so such a page matches only the pages not wiped either
+    mix((uint64_t)page.storage | ((uint64_t)page.layout << 8) | ((uint64_t)page.wipe_data << 16)
+        | ((uint64_t)(uint32_t)page.tile_size << 32));
+}
+
+page_fingerprint& page_fingerprint::add_sprite(raw_pixel_area const& src, raw_image_filling_props const& props) {
+    // The pixels are hashed as they are stored, the rotation is taken separately
+    auto rotation = src.get_rotation();
+    auto dims = src.get_dimensions();
+    if(rotation == raw_pixel_area::rotate_90_degree || rotation == raw_pixel_area::rotate_270_degree)
+        swap(dims.width, dims.height);
+    
+    size_t bytes = (size_t)dims.width * dims.height * pixel_format_details(src.get_pixel_format()).bpp;
+    unsigned char const* pixels = src.get_raw_pixels();
+    
+    mix(pixels ? details::hash64(pixels, bytes) : 0);
+    mix((uint64_t)src.get_pixel_format());
+    mix((uint64_t)(uint32_t)dims.width);
+    mix((uint64_t)(uint32_t)dims.height);
+    mix((uint64_t)rotation);
+    mix(hash_palette(src.props().palette));
+    mix((uint64_t)(uint32_t)props.offset_pos.x);
+    mix((uint64_t)(uint32_t)props.offset_pos.y);
+    mix((props.premultiple ? 1 : 0) | (props.dithering ? 2 : 0));
+    mix((uint64_t)(props.target_channel + 1) | ((uint64_t)props.source_channel << 8));
+    mix((uint64_t)(uint32_t)props.clip_top | ((uint64_t)(uint32_t)props.clip_bottom << 32));
+    return *this;
+}
+
+void page_fingerprint::mix(uint64_t v) {
+    // Order dependent, a sprite set placed in another order gives another fingerprint
+    uint64_t block[2] = {_value, v};
+    _value = details::hash64(block, sizeof(block));
+}
+
+
+page_cache::page_cache(page_cache_params params): _params(move(params)) {
+    ;;
+}
+
+string page_cache::path_of(uint64_t fingerprint) const {
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)fingerprint);
+    return _params.directory + "/" + name + cache_extension;
+}
+
+bool page_cache::load(uint64_t fingerprint, raw_image& page) {
+    const string path = path_of(fingerprint);
+    
+    size_t bytes = 0;
+    auto mapped = map_file(path, bytes);
+    
+    page_header h;
+    bool is_valid = mapped && bytes >= header_size && !memcmp(mapped.get(), cache_magic, sizeof(cache_magic));
+    if(is_valid) {
+        // The header is parsed from the mapping
+        istringstream in(string((char const*)mapped.get(), header_size));
+        in.ignore(sizeof(cache_magic));
+        uint16_t version = 0;
+        is_valid = get(in, version) && version == cache_version
+            && get(in, h.width) && get(in, h.height) && get(in, h.format)
+            && get(in, h.storage) && get(in, h.layout) && get(in, h.tile_size) && get(in, h.data_size)
+            && header_size + h.data_size == bytes;
+        
+        auto const& props = page.props();
+        is_valid = is_valid
+            && h.width == props.dimensions.width && h.height == props.dimensions.height
+            && (pixel_format)h.format == props.format
+            && (raw_storage)h.storage == props.storage
+            && (pixel_layout)h.layout == props.layout && h.tile_size == props.tile_size
+            && h.data_size && h.data_size == stored_size(props);
+    }
+    
+    {
+        lock_guard<mutex> lock(_guard);
+        ++(is_valid ? _stats.hits : _stats.misses);
+    }
+    
+    if(!is_valid)
+        return false;
+    
+    // Touching the file marks it recently used
+    ::utimes(path.c_str(), nullptr);
+    
+    raw_image::init_props props;
+    static_cast<raw_image_props&>(props) = page.props();
+    
+    if(has_buffer(props.storage)) {
+        // The buffer in the page's own layout is kept by the mapping
+        props.set_raw_data(raw_data_ptr(mapped, mapped.get() + header_size));
+        page.init(props);
+        return true;
+    }
+    
+    // The compressed storage takes the rows and compresses them
+    props.set_raw_data(nullptr);
+    page.init(props);
+    
+    const size_t row_size = (size_t)h.width * pixel_format_details(props.format).bpp;
+    unsigned char const* rows = mapped.get() + header_size;
+    for(int y = 0; y < h.height; ++y) {
+        if(!page.write_row(&rows[(size_t)y * row_size], 0, y, h.width))
+            return false;
+    }
+    return page.flush_pixels();
+}
+
+bool page_cache::store(uint64_t fingerprint, raw_image const& page) {
+    auto const& props = page.props();
+    auto dims = page.get_dimensions();
+    auto format = page.get_pixel_format();
+    size_t bpp = pixel_format_details(format).bpp;
+    
+    // A band holds a part of the page only
+    const size_t data_size = stored_size(props);
+    if(dims.width <= 0 || dims.height <= 0 || !bpp || !data_size || props.storage == raw_storage::band)
+        return false;
+    
+    // Written to a temporary file first, so other processes never see a partial page
+    static atomic<unsigned> counter{0};
+    const string path = path_of(fingerprint);
+    const string temp = path + ".tmp." + to_string((long long)::getpid()) + "." + to_string(counter++);
+    
+    bool result = false;
+    {
+        ofstream out(temp.c_str(), ios::binary | ios::trunc);
+        if(!out.is_open())
+            return false;
+        
+        out.write(cache_magic, sizeof(cache_magic));
+        put(out, cache_version);
+        put(out, (int32_t)dims.width);
+        put(out, (int32_t)dims.height);
+        put(out, (uint8_t)format);
+        put(out, (uint8_t)props.storage);
+        put(out, (uint8_t)props.layout);
+        put(out, (int32_t)props.tile_size);
+        put(out, (uint64_t)data_size);
+        
+        // Padding up to the pixels
+        const size_t written = (size_t)out.tellp();
+        vector<char> zeros(header_size - written, 0);
+        out.write(zeros.data(), zeros.size());
+        
+        unsigned char const* pixels = page.get_raw_pixels();
+        if(has_buffer(props.storage) && pixels) {
+            // The buffer is written as is, so a hit gives the same bytes as the page built
+            out.write((char const*)pixels, data_size);
+        }
+        else if(has_buffer(props.storage)) {
+            // The page was never filled
+            vector<char> empty(data_size, 0);
+            out.write(empty.data(), empty.size());
+        }
+        else {
+            vector<unsigned char> row((size_t)dims.width * bpp);
+            for(int y = 0; y < dims.height && out; ++y) {
+                page.read_row(row.data(), y);
+                out.write((char const*)row.data(), row.size());
+            }
+        }
+        
+        out.flush();
+        result = out.good();
+    }
+    
+    if(!result || ::rename(temp.c_str(), path.c_str()) != 0) {
+        ::unlink(temp.c_str());
+        return false;
+    }
+    
+    {
+        lock_guard<mutex> lock(_guard);
+        ++_stats.stores;
+    }
+    
+    evict();
+    return true;
+}
+
+void page_cache::evict() {
+    DIR* dir = ::opendir(_params.directory.c_str());
+    if(!dir)
+        return;
+    
+    vector<cache_entry> entries;
+    uint64_t total = 0;
+    
+    const size_t extension_size = strlen(cache_extension);
+    while(dirent* e = ::readdir(dir)) {
+        string name = e->d_name;
+        if(name.size() <= extension_size || name.compare(name.size() - extension_size, extension_size, cache_extension))
+            continue;
+        
+        string path = _params.directory + "/" + name;
+        struct stat info;
+        if(::stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+            continue;
+        
+        entries.push_back({path, (uint64_t)info.st_size, info.st_mtime});
+        total += (uint64_t)info.st_size;
+    }
+    ::closedir(dir);
+    
+    if(total <= _params.max_bytes)
+        return;
+    
+    // The least recently used go first
+    sort(entries.begin(), entries.end(), [](cache_entry const& a, cache_entry const& b){
+        return a.used < b.used;
+    });
+    
+    size_t evicted = 0;
+    for(auto const& e : entries) {
+        if(total <= _params.max_bytes)
+            break;
+        
+        // Mapped pages stay valid after the unlink
+        if(::unlink(e.path.c_str()) == 0) {
+            total -= e.bytes;
+            ++evicted;
+        }
+    }
+    
+    lock_guard<mutex> lock(_guard);
+    _stats.evictions += evicted;
+}
+
+page_cache_stats page_cache::stats() const {
+    lock_guard<mutex> lock(_guard);
+    return _stats;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "raw_image.hpp"
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace atlas2d {
+    
+    /// Stable fingerprint of the content of a page. Pages having equal fingerprints are built
+    /// of the same sprites placed the same way to the page of the same properties.
+    class page_fingerprint {
+    public:
+        /// Takes the dimensions, the format, the padding, the palette, the storage and the layout of the page
+        explicit page_fingerprint(raw_image_props const& page);
+        
+        /// Takes the pixels, the rotation and the placement of a sprite
+        page_fingerprint& add_sprite(raw_pixel_area const& src, raw_image_filling_props const& props);
+        
+        /// Returns the fingerprint
+        uint64_t value() const { return _value; }
+        
+    private:
+        void mix(uint64_t v);
+        
+        uint64_t _value;
+    };
+    
+    /// A set of parameters of the page cache
+    struct page_cache_params {
+        std::string directory;              ///< The directory must exist
+        uint64_t max_bytes = 1ull << 30;    ///< Size of the cache after which the least recently used pages are evicted
+    };
+    
+    // Helper
+    struct set_page_cache_params: page_cache_params {
+        using self = set_page_cache_params;
+        self& set_directory(std::string arg) {directory=std::move(arg); return *this;}
+        self& set_max_bytes(uint64_t arg) {max_bytes=arg; return *this;}
+    };
+    
+    /// Counters of the cache
+    struct page_cache_stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t stores = 0;
+        size_t evictions = 0;       ///< Pages removed from the cache
+        
+        double hit_rate() const { return hits + misses ? (double)hits / (hits + misses) : 0.0; }
+    };
+    
+    /// Content-addressed cache of the finished pages in a local directory.
+    /// Several processes may share the directory.
+    class page_cache {
+    public:
+        explicit page_cache(page_cache_params params);
+        
+        /// Looks the page up by the fingerprint. On a hit the page is initialized by its props with
+        /// the pixels mapped from the cached file (copy on write) in the layout of the page
+        /// and true is returned. The compressed storage gets the pixels compressed anew.
+        bool load(uint64_t fingerprint, raw_image& page);
+        
+        /// Stores the finished page, then evicts the least recently used pages beyond the size limit.
+        /// Pages of the band storage can't be stored.
+        bool store(uint64_t fingerprint, raw_image const& page);
+        
+        /// Removes the least recently used pages until the cache fits <max_bytes>
+        void evict();
+        
+        page_cache_stats stats() const;
+        
+    private:
+        std::string path_of(uint64_t fingerprint) const;
+        
+        page_cache_params _params;
+        page_cache_stats _stats;
+        mutable std::mutex _guard;
+    };
+    
+} // namespace atlas2d
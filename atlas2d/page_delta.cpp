@@ -0,0 +1,272 @@
+#include "page_delta.hpp"
+#include "raw_image.hpp"
+#include "palette.hpp"
+#include "parallel.hpp"
+#include "serialization.hpp"
+
+#include <cstring>
+#include <istream>
+#include <ostream>
+
+using namespace ::atlas2d;
+using namespace ::std;
+using details::put;
+using details::get;
+using details::put_varint;
+using details::get_varint;
+
+namespace {
+    
+    const char patch_magic[4] = {'A', '2', 'D', 'P'};
+    const uint16_t patch_version = 2;
+    
+    /// Changed tiles of a band of tile rows
+    struct band_delta {
+        vector<uint32_t> tiles;
+        vector<unsigned char> pixels;
+    };
+    
+    /// Geometry of the tiles of a page
+    struct tile_grid {
+        tile_grid(size dims, int tile, size_t bpp): dims(dims), tile(tile), bpp(bpp) {
+            columns = (dims.width + tile - 1) / tile;
+            rows = (dims.height + tile - 1) / tile;
+        }
+        
+        /// Returns dimensions of the tile clipped by the page
+        size tile_dims(size_t index) const {
+            int x = (int)(index % columns) * tile;
+            int y = (int)(index / columns) * tile;
+            return size((min)(tile, dims.width - x), (min)(tile, dims.height - y));
+        }
+        
+        size_t tiles_count() const { return (size_t)columns * rows; }
+        
+        size dims;
+        int tile;
+        size_t bpp;
+        int columns = 0;
+        int rows = 0;
+    };
+    
+    /// Reads rows of the page, a page without pixels gives zeros
+    void read_rows(raw_image const& page, int first, int count, size_t row_size, unsigned char* dst) {
+        for(int i = 0; i < count; ++i)
+            page.read_row(&dst[(size_t)i * row_size], first + i);
+    }
+    
+    /// Compares a band of tiles and collects the changed ones
+    void diff_band(raw_image const& from,
+                   raw_image const& to,
+                   tile_grid const& grid,
+                   int band,
+                   vector<unsigned char>& from_rows,
+                   vector<unsigned char>& to_rows,
+                   vector<bool>& changed,
+                   band_delta& delta)
+    {
+        const size_t row_size = (size_t)grid.dims.width * grid.bpp;
+        const size_t tile_row_size = (size_t)grid.tile * grid.bpp;
+        const int first_row = band * grid.tile;
+        const int rows = (min)(grid.tile, grid.dims.height - first_row);
+        
+        read_rows(from, first_row, rows, row_size, from_rows.data());
+        read_rows(to, first_row, rows, row_size, to_rows.data());
+        
+        changed.assign(grid.columns, false);
+        bool any_changed = false;
+        
+        for(int y = 0; y < rows; ++y) {
+            unsigned char const* a = &from_rows[(size_t)y * row_size];
+            unsigned char const* b = &to_rows[(size_t)y * row_size];
+            
+            // Equal rows are the usual case, skip them at once
+            if(!memcmp(a, b, row_size))
+                continue;
+            
+            for(int tx = 0; tx < grid.columns; ++tx) {
+                if(changed[tx])
+                    continue;
+                
+                size_t begin = tx * tile_row_size;
+                size_t bytes = (min)(tile_row_size, row_size - begin);
+                if(memcmp(&a[begin], &b[begin], bytes)) {
+                    changed[tx] = true;
+                    any_changed = true;
+                }
+            }
+        }
+        
+        if(!any_changed)
+            return;
+        
+        for(int tx = 0; tx < grid.columns; ++tx) {
+            if(!changed[tx])
+                continue;
+            
+            delta.tiles.push_back((uint32_t)((size_t)band * grid.columns + tx));
+            
+            size_t begin = tx * tile_row_size;
+            size_t bytes = (min)(tile_row_size, row_size - begin);
+            for(int y = 0; y < rows; ++y) {
+                unsigned char const* src = &to_rows[(size_t)y * row_size + begin];
+                delta.pixels.insert(delta.pixels.end(), src, src + bytes);
+            }
+        }
+    }
+    
+    /// Returns the size of the pixels the tiles of the patch need
+    bool patch_pixels_size(page_patch const& patch, size_t& bytes) {
+        if(patch.tile_size <= 0 || patch.dimensions.width <= 0 || patch.dimensions.height <= 0)
+            return false;
+        
+        tile_grid grid(patch.dimensions, patch.tile_size, pixel_format_details(patch.format).bpp);
+        if(!grid.bpp)
+            return false;
+        
+        bytes = 0;
+        for(auto index: patch.tiles) {
+            if(index >= grid.tiles_count())
+                return false;
+            
+            auto dims = grid.tile_dims(index);
+            bytes += (size_t)dims.width * dims.height * grid.bpp;
+        }
+        return true;
+    }
+    
+    /// Indices of palette-indexed pages are comparable only if they refer to the same colors
+    bool same_palettes(raw_image const& a, raw_image const& b) {
+        if(a.get_pixel_format() != pixel_format::p8)
+            return true;
+        
+        auto const& pa = a.props().palette;
+        auto const& pb = b.props().palette;
+        return pa == pb || (pa && pb && pa->colors == pb->colors);
+    }
+    
+} // namespace
+
+
+bool atlas2d::diff_pages(raw_image const& from, raw_image const& to, delta_params const& params, page_patch& patch) {
+    auto dims = to.get_dimensions();
+    auto from_dims = from.get_dimensions();
+    if(from_dims.width != dims.width || from_dims.height != dims.height ||
+       from.get_pixel_format() != to.get_pixel_format() || !same_palettes(from, to) ||
+       params.tile_size <= 0 || dims.width <= 0 || dims.height <= 0)
+        return false;
+    
+    tile_grid grid(dims, params.tile_size, pixel_format_details(to.get_pixel_format()).bpp);
+    if(!grid.bpp)
+        return false;
+    
+    patch.dimensions = dims;
+    patch.format = to.get_pixel_format();
+    patch.tile_size = params.tile_size;
+    patch.tiles.clear();
+    patch.pixels.clear();
+    
+    // Every band of tiles is compared independently
+    vector<band_delta> bands(grid.rows);
+    const size_t band_size = (size_t)dims.width * grid.bpp * grid.tile;
+    
+    details::parallel_for(bands.size(), [&](size_t begin, size_t end, size_t) {
+        vector<unsigned char> from_rows(band_size), to_rows(band_size);
+        vector<bool> changed;
+        for(size_t band = begin; band < end; ++band)
+            diff_band(from, to, grid, (int)band, from_rows, to_rows, changed, bands[band]);
+    }, params.threads);
+    
+    for(auto& band: bands) {
+        patch.tiles.insert(patch.tiles.end(), band.tiles.begin(), band.tiles.end());
+        patch.pixels.insert(patch.pixels.end(), band.pixels.begin(), band.pixels.end());
+    }
+    
+    return true;
+}
+
+bool atlas2d::apply_patch(raw_image& page, page_patch const& patch) {
+    auto dims = page.get_dimensions();
+    if(dims.width != patch.dimensions.width || dims.height != patch.dimensions.height ||
+       page.get_pixel_format() != patch.format)
+        return false;
+    
+    size_t bytes = 0;
+    if(!patch_pixels_size(patch, bytes) || bytes != patch.pixels.size())
+        return false;
+    
+    tile_grid grid(patch.dimensions, patch.tile_size, pixel_format_details(patch.format).bpp);
+    
+    unsigned char const* src = patch.pixels.data();
+    for(auto index: patch.tiles) {
+        auto tile_dims = grid.tile_dims(index);
+        int x = (int)(index % grid.columns) * grid.tile;
+        int y = (int)(index / grid.columns) * grid.tile;
+        
+        for(int row = 0; row < tile_dims.height; ++row) {
+            if(!page.write_row(src, x, y + row, tile_dims.width))
+                return false;
+            src += (size_t)tile_dims.width * grid.bpp;
+        }
+    }
+    
+    // The compressed storage keeps the written tiles decompressed until they are flushed
+    return page.flush_pixels();
+}
+
+bool atlas2d::write_patch(ostream& out, page_patch const& patch) {
+    out.write(patch_magic, sizeof(patch_magic));
+    put(out, patch_version);
+    put(out, (int32_t)patch.dimensions.width);
+    put(out, (int32_t)patch.dimensions.height);
+    put(out, (uint8_t)patch.format);
+    put(out, (int32_t)patch.tile_size);
+    put(out, (uint32_t)patch.tiles.size());
+    
+    // Indices are written as varint deltas, they grow and mostly are close to each other
+    uint32_t prev = 0;
+    for(auto index: patch.tiles) {
+        put_varint(out, index - prev);
+        prev = index;
+    }
+    
+    put(out, (uint64_t)patch.pixels.size());
+    out.write((char const*)patch.pixels.data(), patch.pixels.size());
+    return out.good();
+}
+
+bool atlas2d::read_patch(istream& in, page_patch& patch) {
+    char magic[sizeof(patch_magic)];
+    uint16_t version = 0;
+    if(!in.read(magic, sizeof(magic)) || memcmp(magic, patch_magic, sizeof(magic)) ||
+       !get(in, version) || version != patch_version)
+        return false;
+    
+    int32_t width = 0, height = 0, tile_size = 0;
+    uint8_t format = 0;
+    uint32_t tiles_count = 0;
+    if(!get(in, width) || !get(in, height) || !get(in, format) || !get(in, tile_size) || !get(in, tiles_count))
+        return false;
+    
+    patch.dimensions = size(width, height);
+    patch.format = (pixel_format)format;
+    patch.tile_size = tile_size;
+    patch.tiles.clear();
+    
+    uint32_t prev = 0;
+    for(uint32_t i = 0; i < tiles_count; ++i) {
+        uint32_t delta = 0;
+        if(!get_varint(in, delta))
+            return false;
+        prev += delta;
+        patch.tiles.push_back(prev);
+    }
+    
+    size_t expected = 0;
+    uint64_t bytes = 0;
+    if(!get(in, bytes) || !patch_pixels_size(patch, expected) || bytes != expected)
+        return false;
+    
+    patch.pixels.resize((size_t)bytes);
+    return (bool)in.read((char*)patch.pixels.data(), patch.pixels.size());
+}
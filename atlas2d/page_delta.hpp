@@ -0,0 +1,53 @@
+#pragma once
+
+#include "forwards.hpp"
+#include "pixel_format.hpp"
+
+#include <cstdint>
+#include <iosfwd>
+#include <vector>
+
+namespace atlas2d {
+    
+    class raw_image;
+    
+    /// A set of parameters of comparing pages
+    struct delta_params {
+        int tile_size = 32;     ///< Side of the compared tiles in pixels
+        size_t threads = 0;     ///< Workers count, 0 means the count of CPUs
+    };
+    
+    // Helper
+    struct set_delta_params: delta_params {
+        using self = set_delta_params;
+        self& set_tile_size(int arg) {tile_size=arg; return *this;}
+        self& set_threads(size_t arg) {threads=arg; return *this;}
+    };
+    
+    /// Changed tiles of a page
+    struct page_patch {
+        size dimensions = size(0, 0);
+        pixel_format format = pixel_format::unknown;
+        int tile_size = 0;
+        std::vector<uint32_t> tiles;        ///< Indices of the changed tiles in the row-major order
+        std::vector<unsigned char> pixels;  ///< Pixels of the changed tiles one after another, row by row.
+                                            ///< The tiles on the right and bottom edges are clipped by the page.
+        
+        bool empty() const { return tiles.empty(); }
+    };
+    
+    /// Compares two pages of the same dimensions and format and collects the tiles of <to>
+    /// differing from <from>. Pages without pixels are compared as zeroed ones.
+    /// Returns false if the pages can't be compared, palette-indexed pages must have the same colors.
+    bool diff_pages(raw_image const& from, raw_image const& to, delta_params const& params, page_patch& patch);
+    
+    /// Writes the tiles of the patch to the page. Returns false if the patch doesn't match the page.
+    bool apply_patch(raw_image& page, page_patch const& patch);
+    
+    /// Serializes the patch to a compact binary form
+    bool write_patch(std::ostream& out, page_patch const& patch);
+    
+    /// Reads the patch written by write_patch(). Returns false if the data is malformed.
+    bool read_patch(std::istream& in, page_patch& patch);
+    
+} // namespace atlas2d
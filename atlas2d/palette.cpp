@@ -0,0 +1,427 @@
+#include "palette.hpp"
+#include "parallel.hpp"
+#include "pixel_format.hpp"
+#include "raw_pixel_area.hpp"
+
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+using namespace ::atlas2d;
+using namespace ::atlas2d::details;
+using namespace ::std;
+
+namespace {
+    
+    inline int channel_of(uint32_t pixel, int c) {
+        return (pixel >> (c * 8)) & 0xFF;
+    }
+    
+    inline uint32_t pack_pixel(int r, int g, int b, int a) {
+        return (uint32_t)r | ((uint32_t)g << 8) | ((uint32_t)b << 16) | ((uint32_t)a << 24);
+    }
+    
+    /// A reference to the row of a source area
+    struct row_ref {
+        size_t area;
+        int row;
+    };
+    
+    /// Reads rows of the areas in rgba8 format
+    class rgba8_row_reader {
+    public:
+        explicit rgba8_row_reader(palette_sources const& areas): _areas(areas) { ;; }
+        
+        /// Returns pointer to the row's pixels or nullptr if the area can't be read as rgba8
+        uint32_t const* read(row_ref const& ref) {
+            auto const& area = *_areas[ref.area];
+            auto width = (size_t)area.get_dimensions().width;
+            auto fmt = area.get_pixel_format();
+            auto src_bpp = (size_t)pixel_format_details(fmt).bpp;
+            
+            _src.resize(width * src_bpp);
+            area.read_row(_src.data(), ref.row);
+            if(fmt == pixel_format::rgba8)
+                return (uint32_t const*)_src.data();
+            
+            if(_area != ref.area) {
+                _area = ref.area;
+                _converter = create_pixel_converter(set_converter_params()
+                                                    .set_src_fmt(fmt)
+                                                    .set_dst_fmt(pixel_format::rgba8)
+                                                    .set_palette(area.props().palette)
+                                                    .set_pixels_count(width)
+                                                    .set_margins(0, 0));
+            }
+            
+            if(!_converter)
+                return nullptr;
+            
+            _dst.resize(width * 4);
+            (*_converter)(_src.data(), _dst.data(), width);
+            return (uint32_t const*)_dst.data();
+        }
+        
+    private:
+        palette_sources const& _areas;
+        size_t _area = (size_t)-1;
+        pixel_converter_ptr _converter;
+        vector<unsigned char> _src;
+        vector<unsigned char> _dst;
+    };
+    
+    vector<row_ref> rows_of(palette_sources const& areas) {
+        vector<row_ref> rows;
+        for(size_t i = 0; i < areas.size(); ++i) {
+            int height = areas[i]->get_dimensions().height;
+            for(int y = 0; y < height; ++y)
+                rows.push_back(row_ref{i, y});
+        }
+        return rows;
+    }
+    
+    /// A color with the count of its occurrences
+    struct weighted_color {
+        uint32_t color;
+        uint32_t count;
+    };
+    
+    /// Builds the histogram of colors. Rows are split between workers, each worker counts
+    /// colors into its own table and the tables are merged at the end.
+    vector<weighted_color> collect_histogram(palette_sources const& areas, size_t threads) {
+        auto rows = rows_of(areas);
+        const size_t workers = workers_count_for(rows.size(), threads);
+        vector<unordered_map<uint32_t, uint32_t>> tables(workers);
+        
+        parallel_for(rows.size(), [&](size_t begin, size_t end, size_t worker){
+            rgba8_row_reader reader(areas);
+            auto& table = tables[worker];
+            
+            for(size_t i = begin; i < end; ++i) {
+                auto pixels = reader.read(rows[i]);
+                if(!pixels)
+                    continue;
+                
+                int width = areas[rows[i].area]->get_dimensions().width;
+                uint32_t prev = 0;
+                uint32_t* prev_count = nullptr;
+                for(int x = 0; x < width; ++x) {
+                    // Runs of the same color are common in atlases, skip the hashing for them
+                    if(prev_count && pixels[x] == prev) {
+                        ++(*prev_count);
+                        continue;
+                    }
+                    prev = pixels[x];
+                    prev_count = &table[prev];
+                    ++(*prev_count);
+                }
+            }
+        }, workers);
+        
+        for(size_t i = 1; i < tables.size(); ++i) {
+            for(auto const& entry : tables[i])
+                tables[0][entry.first] += entry.second;
+        }
+        
+        vector<weighted_color> histogram;
+        histogram.reserve(tables[0].size());
+        for(auto const& entry : tables[0])
+            histogram.push_back(weighted_color{entry.first, entry.second});
+        
+        return histogram;
+    }
+    
+    /// A box of the color space used by median cut
+    struct color_box {
+        size_t begin;
+        size_t end;
+        int widest_channel;
+        int range;
+        uint64_t population;
+    };
+    
+    color_box make_box(vector<weighted_color> const& colors, size_t begin, size_t end) {
+        int lo[4] = {255, 255, 255, 255};
+        int hi[4] = {0, 0, 0, 0};
+        uint64_t population = 0;
+        
+        for(size_t i = begin; i < end; ++i) {
+            for(int c = 0; c < 4; ++c) {
+                int v = channel_of(colors[i].color, c);
+                lo[c] = (std::min)(lo[c], v);
+                hi[c] = (std::max)(hi[c], v);
+            }
+            population += colors[i].count;
+        }
+        
+        color_box box{begin, end, 0, -1, population};
+        for(int c = 0; c < 4; ++c) {
+            if(hi[c] - lo[c] > box.range) {
+                box.range = hi[c] - lo[c];
+                box.widest_channel = c;
+            }
+        }
+        return box;
+    }
+    
+    uint32_t mean_color(vector<weighted_color> const& colors, size_t begin, size_t end) {
+        uint64_t sum[4] = {0, 0, 0, 0};
+        uint64_t total = 0;
+        for(size_t i = begin; i < end; ++i) {
+            for(int c = 0; c < 4; ++c)
+                sum[c] += (uint64_t)channel_of(colors[i].color, c) * colors[i].count;
+            total += colors[i].count;
+        }
+        
+        if(!total)
+            return colors[begin].color;
+        
+        return pack_pixel((int)((sum[0] + total / 2) / total),
+                          (int)((sum[1] + total / 2) / total),
+                          (int)((sum[2] + total / 2) / total),
+                          (int)((sum[3] + total / 2) / total));
+    }
+    
+    /// Splits the color space into <max_colors> boxes by the weighted median of the widest channel
+    vector<uint32_t> median_cut(vector<weighted_color>& colors, size_t max_colors) {
+        vector<color_box> boxes = {make_box(colors, 0, colors.size())};
+        
+        while(boxes.size() < max_colors) {
+            // The box with the widest range weighted by its population goes first
+            auto it = max_element(boxes.begin(), boxes.end(), [](color_box const& a, color_box const& b){
+                return (double)a.range * a.population < (double)b.range * b.population;
+            });
+            
+            if(it->range <= 0 || it->end - it->begin < 2)
+                break;
+            
+            color_box box = *it;
+            int ch = box.widest_channel;
+            sort(colors.begin() + box.begin, colors.begin() + box.end, [ch](weighted_color const& a, weighted_color const& b){
+                return channel_of(a.color, ch) < channel_of(b.color, ch);
+            });
+            
+            uint64_t half = box.population / 2;
+            uint64_t acc = 0;
+            size_t split = box.begin + 1;
+            for(size_t i = box.begin; i + 1 < box.end; ++i) {
+                acc += colors[i].count;
+                split = i + 1;
+                if(acc >= half)
+                    break;
+            }
+            
+            *it = make_box(colors, box.begin, split);
+            boxes.push_back(make_box(colors, split, box.end));
+        }
+        
+        vector<uint32_t> palette;
+        palette.reserve(boxes.size());
+        for(auto const& box : boxes)
+            palette.push_back(mean_color(colors, box.begin, box.end));
+        
+        return palette;
+    }
+    
+    inline int color_distance(uint32_t a, uint32_t b) {
+        int dist = 0;
+        for(int c = 0; c < 4; ++c) {
+            int d = channel_of(a, c) - channel_of(b, c);
+            dist += d * d;
+        }
+        return dist;
+    }
+    
+    size_t nearest_index(vector<uint32_t> const& palette, uint32_t color) {
+        size_t best = 0;
+        int best_dist = color_distance(palette[0], color);
+        for(size_t i = 1; i < palette.size() && best_dist; ++i) {
+            int dist = color_distance(palette[i], color);
+            if(dist < best_dist) {
+                best_dist = dist;
+                best = i;
+            }
+        }
+        return best;
+    }
+    
+    /// Moves every palette entry to the weighted mean of the colors nearest to it
+    void refine_palette(vector<uint32_t>& palette, vector<weighted_color> const& colors, int iterations, size_t threads) {
+        const size_t workers = workers_count_for(colors.size(), threads);
+        
+        using accumulator = vector<uint64_t>;
+        for(int it = 0; it < iterations; ++it) {
+            vector<accumulator> sums(workers, accumulator(palette.size() * 5, 0));
+            
+            parallel_for(colors.size(), [&](size_t begin, size_t end, size_t worker){
+                auto& acc = sums[worker];
+                for(size_t i = begin; i < end; ++i) {
+                    size_t k = nearest_index(palette, colors[i].color);
+                    for(int c = 0; c < 4; ++c)
+                        acc[k * 5 + c] += (uint64_t)channel_of(colors[i].color, c) * colors[i].count;
+                    acc[k * 5 + 4] += colors[i].count;
+                }
+            }, workers);
+            
+            bool changed = false;
+            for(size_t k = 0; k < palette.size(); ++k) {
+                uint64_t s[5] = {0, 0, 0, 0, 0};
+                for(auto const& acc : sums) {
+                    for(int c = 0; c < 5; ++c)
+                        s[c] += acc[k * 5 + c];
+                }
+                
+                if(!s[4])
+                    continue;
+                
+                uint32_t color = pack_pixel((int)((s[0] + s[4] / 2) / s[4]),
+                                            (int)((s[1] + s[4] / 2) / s[4]),
+                                            (int)((s[2] + s[4] / 2) / s[4]),
+                                            (int)((s[3] + s[4] / 2) / s[4]));
+                changed = changed || color != palette[k];
+                palette[k] = color;
+            }
+            
+            if(!changed)
+                break;
+        }
+    }
+    
+    /// 4x4 Bayer threshold matrix
+    const int bayer4[4][4] = {
+        { 0,  8,  2, 10},
+        {12,  4, 14,  6},
+        { 3, 11,  1,  9},
+        {15,  7, 13,  5},
+    };
+    
+} // namespace
+
+
+palette_ptr atlas2d::build_exact_palette(palette_sources const& areas, palette_params const& params) {
+    const auto max_colors = (std::min)(params.max_colors, (size_t)256);
+    if(!max_colors)
+        return nullptr;
+    
+    auto rows = rows_of(areas);
+    const size_t workers = workers_count_for(rows.size(), params.threads);
+    vector<unordered_set<uint32_t>> sets(workers);
+    atomic<bool> overflow(false);
+    
+    parallel_for(rows.size(), [&](size_t begin, size_t end, size_t worker){
+        rgba8_row_reader reader(areas);
+        auto& colors = sets[worker];
+        
+        for(size_t i = begin; i < end && !overflow; ++i) {
+            auto pixels = reader.read(rows[i]);
+            if(!pixels) {
+                overflow = true;
+                break;
+            }
+            
+            int width = areas[rows[i].area]->get_dimensions().width;
+            for(int x = 0; x < width; ++x) {
+                if(x && pixels[x] == pixels[x - 1])
+                    continue;
+                colors.insert(pixels[x]);
+            }
+            
+            if(colors.size() > max_colors)
+                overflow = true;
+        }
+    }, workers);
+    
+    if(overflow)
+        return nullptr;
+    
+    for(size_t i = 1; i < sets.size(); ++i)
+        sets[0].insert(sets[i].begin(), sets[i].end());
+    
+    if(sets[0].size() > max_colors)
+        return nullptr;
+    
+    auto palette = make_shared<pixel_palette>();
+    palette->colors.assign(sets[0].begin(), sets[0].end());
+    sort(palette->colors.begin(), palette->colors.end());
+    return palette;
+}
+
+palette_ptr atlas2d::build_palette(palette_sources const& areas, palette_params const& params) {
+    auto max_colors = (std::min)(params.max_colors, (size_t)256);
+    if(!max_colors)
+        return nullptr;
+    
+    auto histogram = collect_histogram(areas, params.threads);
+    if(histogram.empty())
+        return nullptr;
+    
+    auto palette = make_shared<pixel_palette>();
+    if(histogram.size() <= max_colors) {
+        // The fast path: all of the colors fit into the palette
+        for(auto const& entry : histogram)
+            palette->colors.push_back(entry.color);
+        sort(palette->colors.begin(), palette->colors.end());
+        return palette;
+    }
+    
+    palette->colors = median_cut(histogram, max_colors);
+    refine_palette(palette->colors, histogram, params.refine_iterations, params.threads);
+    return palette;
+}
+
+pixel_converter::callback details::create_palette_mapper(palette_ptr palette, bool dithering, shared_ptr<offset const> origin) {
+    if(!palette || palette->colors.empty() || palette->colors.size() > 256)
+        return nullptr;
+    
+    // Colors already seen are looked up in the cache instead of searching the palette
+    auto cache = make_shared<unordered_map<uint32_t, unsigned char>>();
+    for(size_t i = 0; i < palette->colors.size(); ++i)
+        cache->emplace(palette->colors[i], (unsigned char)i);
+    
+    // The spread of dithering is about the distance between palette colors
+    const float spread = dithering ? 255.0f / std::cbrt((float)palette->colors.size()) : 0.0f;
+    
+    return [=](unsigned char* src, unsigned char* dst, size_t count) {
+        uint32_t const* in = (uint32_t const*)src;
+        auto const& colors = palette->colors;
+        const int x = origin ? origin->x : 0;
+        const int y = origin ? origin->y : 0;
+        
+        for(size_t i = 0; i < count; ++i) {
+            uint32_t color = in[i];
+            if(dithering) {
+                int offset = (int)((bayer4[y & 3][(x + (int)i) & 3] - 7.5f) / 16.0f * spread);
+                int r = (std::min)(255, (std::max)(0, channel_of(color, 0) + offset));
+                int g = (std::min)(255, (std::max)(0, channel_of(color, 1) + offset));
+                int b = (std::min)(255, (std::max)(0, channel_of(color, 2) + offset));
+                color = pack_pixel(r, g, b, channel_of(color, 3));
+            }
+            
+            auto found = cache->find(color);
+            if(found == cache->end())
+                found = cache->emplace(color, (unsigned char)nearest_index(colors, color)).first;
+            
+            dst[i] = found->second;
+        }
+    };
+}
+
+pixel_converter::callback details::create_palette_expander(palette_ptr palette) {
+    if(!palette || palette->colors.empty())
+        return nullptr;
+    
+    // Out of range indices are expanded to the transparent black
+    auto table = make_shared<array<uint32_t, 256>>();
+    table->fill(0);
+    copy(palette->colors.begin(),
+         palette->colors.begin() + (std::min)(palette->colors.size(), (size_t)256),
+         table->begin());
+    
+    return [=](unsigned char* src, unsigned char* dst, size_t count) {
+        uint32_t* out = (uint32_t*)dst;
+        for(size_t i = 0; i < count; ++i)
+            out[i] = (*table)[src[i]];
+    };
+}
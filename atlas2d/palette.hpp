@@ -0,0 +1,55 @@
+#pragma once
+
+#include "forwards.hpp"
+#include "pixel_converter.hpp"
+
+#include <vector>
+#include <cstdint>
+
+namespace atlas2d {
+    
+    class raw_pixel_area;
+    
+    /// A color table of a palette-indexed image
+    struct pixel_palette {
+        std::vector<uint32_t> colors;   ///< rgba8 colors packed the same way as rgba8 pixels, 256 at most
+    };
+    
+    /// A set of parameters for building a palette
+    struct palette_params {
+        size_t max_colors = 256;        ///< Palette size limit
+        int refine_iterations = 4;      ///< k-means passes made after the median cut
+        size_t threads = 0;             ///< Workers count, 0 stands for the hardware concurrency
+    };
+    
+    // Helper
+    struct set_palette_params: palette_params {
+        using self = set_palette_params;
+        self& set_max_colors(size_t arg) {max_colors=arg; return *this;}
+        self& set_refine_iterations(int arg) {refine_iterations=arg; return *this;}
+        self& set_threads(size_t arg) {threads=arg; return *this;}
+    };
+    
+    using palette_sources = std::vector<raw_pixel_area const*>;
+    
+    /// Collects the colors of <areas> and returns them as a palette if they are not more than <max_colors>.
+    /// Returns nullptr otherwise.
+    palette_ptr build_exact_palette(palette_sources const& areas, palette_params const& params = palette_params());
+    
+    /// Returns the exact palette of <areas> when it's possible, otherwise quantizes
+    /// the colors by the median cut followed by k-means refinement.
+    palette_ptr build_palette(palette_sources const& areas, palette_params const& params = palette_params());
+    
+    namespace details {
+        
+        /// Creates a callback that maps rgba8 pixels to indices of <palette>.
+        /// The dithering pattern is aligned to the destination position of the first pixel <origin> points to.
+        pixel_converter::callback create_palette_mapper(palette_ptr palette, bool dithering,
+                                                        std::shared_ptr<offset const> origin = nullptr);
+        
+        /// Creates a callback that expands indices of <palette> to rgba8 pixels
+        pixel_converter::callback create_palette_expander(palette_ptr palette);
+        
+    } // namespace details
+    
+} // namespace atlas2d
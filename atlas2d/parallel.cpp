@@ -0,0 +1,46 @@
+#include "parallel.hpp"
+
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+using namespace ::atlas2d;
+using namespace ::atlas2d::details;
+
+size_t details::default_workers_count() {
+    size_t count = std::thread::hardware_concurrency();
+    return count ? count : 1;
+}
+
+size_t details::workers_count_for(size_t items_count, size_t threads) {
+    if(!threads)
+        threads = default_workers_count();
+    
+    return (std::max)((size_t)1, (std::min)(threads, items_count));
+}
+
+void details::parallel_for(size_t items_count, parallel_job const& job, size_t threads) {
+    if(!items_count)
+        return;
+    
+    const size_t workers = workers_count_for(items_count, threads);
+    const size_t chunk = (items_count + workers - 1) / workers;
+    
+    std::vector<std::thread> pool;
+    pool.reserve(workers - 1);
+    
+    for(size_t i = 1; i < workers; ++i) {
+        size_t begin = i * chunk;
+        size_t end = (std::min)(begin + chunk, items_count);
+        if(begin >= end)
+            break;
+        
+        pool.emplace_back([&job, begin, end, i](){ job(begin, end, i); });
+    }
+    
+    // The calling thread does its part of the work too
+    job(0, (std::min)(chunk, items_count), 0);
+    
+    for(auto& t : pool)
+        t.join();
+}
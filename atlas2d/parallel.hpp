@@ -0,0 +1,25 @@
+#pragma once
+
+#include <functional>
+#include <cstddef>
+
+namespace atlas2d {
+    
+    namespace details {
+        
+        /// A chunk of work: [begin, end) range of items and the index of the worker
+        using parallel_job = std::function<void(size_t begin, size_t end, size_t worker)>;
+        
+        /// Returns the count of workers to be used when <threads> is zero
+        size_t default_workers_count();
+        
+        /// Returns the count of workers parallel_for() uses for <items_count> items
+        size_t workers_count_for(size_t items_count, size_t threads = 0);
+        
+        /// Splits [0, items_count) into contiguous chunks and processes them on several threads.
+        /// The calling thread takes the first chunk. Blocks until all of the chunks are done.
+        void parallel_for(size_t items_count, parallel_job const& job, size_t threads = 0);
+        
+    } // namespace details
+    
+} // namespace atlas2d
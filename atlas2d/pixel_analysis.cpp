@@ -0,0 +1,216 @@
+#include "pixel_analysis.hpp"
+#include "pixel_converter.hpp"
+#include "parallel.hpp"
+
+#include <atomic>
+#include <unordered_set>
+#include <vector>
+#include <cmath>
+
+using namespace ::atlas2d;
+using namespace ::atlas2d::details;
+using namespace ::std;
+
+namespace {
+    
+    /// Partial results of a worker
+    struct analysis_acc {
+        uint64_t pixels = 0;
+        uint32_t alpha_and = 0xFF;
+        uint64_t non_binary_alpha = 0;
+        uint64_t rgba4_sse = 0;
+        uint64_t rgb565_sse = 0;
+        uint64_t alpha_loss_sse = 0;
+        unordered_set<uint32_t> colors;
+        bool colors_overflow = false;
+    };
+    
+    /// Quantization error of keeping the high <bits> of a channel (the low bits are restored by replication)
+    inline int quantization_error(uint32_t v, int bits) {
+        uint32_t q = v >> (8 - bits);
+        uint32_t restored = (q << (8 - bits)) | (q >> (2 * bits - 8));
+        return (int)v - (int)restored;
+    }
+    
+    /// Statistics of a row of rgba8 pixels. The loop has no branches so compilers vectorize it.
+    void analyze_row(uint32_t const* pixels, size_t count, analysis_acc& acc) {
+        uint32_t alpha_and = 0xFF;
+        uint64_t non_binary = 0;
+        uint64_t rgba4_sse = 0;
+        uint64_t rgb565_sse = 0;
+        uint64_t alpha_sse = 0;
+        
+        for(size_t i = 0; i < count; ++i) {
+            uint32_t p = pixels[i];
+            uint32_t r = p & 0xFF;
+            uint32_t g = (p >> 8) & 0xFF;
+            uint32_t b = (p >> 16) & 0xFF;
+            uint32_t a = p >> 24;
+            
+            alpha_and &= a;
+            non_binary += (a != 0) & (a != 0xFF);
+            
+            int er4 = quantization_error(r, 4), eg4 = quantization_error(g, 4);
+            int eb4 = quantization_error(b, 4), ea4 = quantization_error(a, 4);
+            rgba4_sse += (uint32_t)(er4 * er4 + eg4 * eg4 + eb4 * eb4 + ea4 * ea4);
+            
+            int er5 = quantization_error(r, 5), eg6 = quantization_error(g, 6), eb5 = quantization_error(b, 5);
+            rgb565_sse += (uint32_t)(er5 * er5 + eg6 * eg6 + eb5 * eb5);
+            
+            uint32_t alpha_loss = 0xFF - a;
+            alpha_sse += alpha_loss * alpha_loss;
+        }
+        
+        acc.pixels += count;
+        acc.alpha_and &= alpha_and;
+        acc.non_binary_alpha += non_binary;
+        acc.rgba4_sse += rgba4_sse;
+        acc.rgb565_sse += rgb565_sse;
+        acc.alpha_loss_sse += alpha_sse;
+    }
+    
+    void count_colors(uint32_t const* pixels, size_t count, size_t limit, analysis_acc& acc) {
+        if(acc.colors_overflow)
+            return;
+        
+        for(size_t i = 0; i < count; ++i) {
+            if(i && pixels[i] == pixels[i - 1])
+                continue;
+            
+            acc.colors.insert(pixels[i]);
+            if(acc.colors.size() > limit) {
+                acc.colors_overflow = true;
+                return;
+            }
+        }
+    }
+    
+    inline double rms(uint64_t sse, uint64_t samples) {
+        return samples ? std::sqrt((double)sse / (double)samples) : 0.0;
+    }
+    
+} // namespace
+
+
+pixel_analysis details::analyze_rows(size dims,
+                                     pixel_format format,
+                                     palette_ptr const& palette,
+                                     row_reader const& reader,
+                                     analysis_params const& params)
+{
+    pixel_analysis result;
+    if(dims.width <= 0 || dims.height <= 0)
+        return result;
+    
+    const size_t width = (size_t)dims.width;
+    const size_t src_bpp = (size_t)pixel_format_details(format).bpp;
+    
+    // p8 without a palette or a format without a conversion path can't be analyzed
+    auto create_converter = [&]() {
+        return create_pixel_converter(set_converter_params()
+                                      .set_src_fmt(format)
+                                      .set_dst_fmt(pixel_format::rgba8)
+                                      .set_pixels_count(width)
+                                      .set_margins(0, 0)
+                                      .set_palette(palette));
+    };
+    
+    if(!src_bpp || (format != pixel_format::rgba8 && !create_converter())) {
+        result.failed = true;
+        return result;
+    }
+    
+    const size_t workers = workers_count_for((size_t)dims.height, params.threads);
+    vector<analysis_acc> accs(workers);
+    atomic<bool> failed(false);
+    
+    parallel_for((size_t)dims.height, [&](size_t begin, size_t end, size_t worker){
+        auto& acc = accs[worker];
+        
+        pixel_converter_ptr converter;
+        if(format != pixel_format::rgba8) {
+            converter = create_converter();
+            if(!converter) {
+                failed = true;
+                return;
+            }
+        }
+        
+        vector<unsigned char> src(width * src_bpp);
+        vector<uint32_t> rgba(converter ? width : 0);
+        
+        for(size_t y = begin; y < end; ++y) {
+            reader(src.data(), (int)y);
+            
+            uint32_t const* pixels = (uint32_t const*)src.data();
+            if(converter) {
+                (*converter)(src.data(), (unsigned char*)rgba.data(), width);
+                pixels = rgba.data();
+            }
+            
+            analyze_row(pixels, width, acc);
+            count_colors(pixels, width, params.max_distinct_colors, acc);
+        }
+    }, workers);
+    
+    if(failed) {
+        result.failed = true;
+        return result;
+    }
+    
+    analysis_acc total;
+    for(auto& acc : accs) {
+        total.pixels += acc.pixels;
+        total.alpha_and &= acc.alpha_and;
+        total.non_binary_alpha += acc.non_binary_alpha;
+        total.rgba4_sse += acc.rgba4_sse;
+        total.rgb565_sse += acc.rgb565_sse;
+        total.alpha_loss_sse += acc.alpha_loss_sse;
+        
+        total.colors_overflow = total.colors_overflow || acc.colors_overflow;
+        if(!total.colors_overflow) {
+            total.colors.insert(acc.colors.begin(), acc.colors.end());
+            total.colors_overflow = total.colors.size() > params.max_distinct_colors;
+        }
+    }
+    
+    const uint64_t samples = total.pixels * 4;
+    result.pixels_count = (size_t)total.pixels;
+    result.opaque = total.pixels == 0 || total.alpha_and == 0xFF;
+    result.binary_alpha = total.non_binary_alpha == 0;
+    result.distinct_colors = total.colors_overflow ? params.max_distinct_colors + 1 : total.colors.size();
+    result.colors_overflow = total.colors_overflow;
+    result.rgba4_error = rms(total.rgba4_sse, samples);
+    result.rgb565_error = rms(total.rgb565_sse + total.alpha_loss_sse, samples);
+    result.rgb8_error = rms(total.alpha_loss_sse, samples);
+    
+    return result;
+}
+
+pixel_format atlas2d::default_format_policy(pixel_analysis const& analysis, format_policy_params const& params) {
+    if(analysis.failed || !analysis.pixels_count)
+        return pixel_format::unknown;
+    
+    // The count is exact only if the colors didn't overflow the limit of the analysis
+    const bool fits_palette = !analysis.colors_overflow && analysis.distinct_colors <= 256;
+    if(params.allow_palette && fits_palette)
+        return pixel_format::p8;
+    
+    if(analysis.rgb565_error <= params.max_error)
+        return pixel_format::rgb565;
+    
+    if(analysis.rgba4_error <= params.max_error)
+        return pixel_format::rgba4;
+    
+    if(analysis.rgb8_error <= params.max_error)
+        return pixel_format::rgb8;
+    
+    return pixel_format::rgba8;
+}
+
+pixel_format atlas2d::select_pixel_format(pixel_analysis const& analysis,
+                                          format_policy_params const& params,
+                                          format_policy const& policy)
+{
+    return policy ? policy(analysis, params) : default_format_policy(analysis, params);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "forwards.hpp"
+#include "pixel_format.hpp"
+
+#include <functional>
+
+namespace atlas2d {
+    
+    /// Results of the analysis of an area's pixels
+    struct pixel_analysis {
+        size_t pixels_count = 0;        ///< Count of analyzed pixels
+        bool failed = false;            ///< The pixels can't be converted to rgba8, nothing is analyzed
+        bool opaque = true;             ///< All of the pixels have alpha of 255
+        bool binary_alpha = true;       ///< Alpha is either 0 or 255
+        size_t distinct_colors = 0;     ///< Count of colors, <max_distinct_colors> + 1 means "more than the limit"
+        bool colors_overflow = false;   ///< There are more than <max_distinct_colors> colors
+        double rgba4_error = 0;         ///< RMS error per channel of storing the pixels as rgba4
+        double rgb565_error = 0;        ///< RMS error per channel of storing the pixels as rgb565 (alpha loss included)
+        double rgb8_error = 0;          ///< RMS error per channel of storing the pixels as rgb8 (alpha loss)
+    };
+    
+    /// A set of parameters of the analysis
+    struct analysis_params {
+        size_t max_distinct_colors = 256;   ///< Colors counting stops beyond this limit
+        size_t threads = 0;                 ///< Workers count, 0 stands for the hardware concurrency
+    };
+    
+    // Helper
+    struct set_analysis_params: analysis_params {
+        using self = set_analysis_params;
+        self& set_max_distinct_colors(size_t arg) {max_distinct_colors=arg; return *this;}
+        self& set_threads(size_t arg) {threads=arg; return *this;}
+    };
+    
+    /// Constraints for selecting a pixel format
+    struct format_policy_params {
+        double max_error = 1.5;         ///< Max tolerable RMS error per channel, in 0..255 units
+        bool allow_palette = true;      ///< p8 may be selected (the caller has to build the palette)
+    };
+    
+    // Helper
+    struct set_format_policy_params: format_policy_params {
+        using self = set_format_policy_params;
+        self& set_max_error(double arg) {max_error=arg; return *this;}
+        self& enable_palette(bool arg=true) {allow_palette=arg; return *this;}
+    };
+    
+    /// A hook that picks the pixel format by the analysis results
+    using format_policy = std::function<pixel_format(pixel_analysis const&, format_policy_params const&)>;
+    
+    /// Picks the most compact format whose error is within the tolerance:
+    /// p8 (lossless only), rgb565, rgba4, rgb8 and rgba8 at last.
+    /// Returns pixel_format::unknown if no pixels were analyzed.
+    pixel_format default_format_policy(pixel_analysis const& analysis, format_policy_params const& params);
+    
+    /// Selects the pixel format for the analyzed pixels by the <policy>
+    pixel_format select_pixel_format(pixel_analysis const& analysis,
+                                     format_policy_params const& params = format_policy_params(),
+                                     format_policy const& policy = default_format_policy);
+    
+    namespace details {
+        
+        /// Reads the row of an area into the buffer
+        using row_reader = std::function<void(unsigned char* dst, int row)>;
+        
+        /// Analyzes the rows of an area
+        pixel_analysis analyze_rows(size dims,
+                                    pixel_format format,
+                                    palette_ptr const& palette,
+                                    row_reader const& reader,
+                                    analysis_params const& params);
+        
+    } // namespace details
+    
+} // namespace atlas2d
@@ -1,7 +1,11 @@
 #include "pixel_converter.hpp"
 #include "pixel_format.hpp"
+#include "palette.hpp"
+#include "memory_budget.hpp"
+#include "half_float.hpp"
 
 #include <cassert>
+#include <cstring>
 #include <set>
 #include <memory>
 #include <deque>
@@ -31,14 +35,33 @@ namespace {
         }
     }
     
+    void mirror_rgba16(unsigned char* src, unsigned char* dst, size_t count) {
+        for(size_t i = 0; i < count; ++i) {
+            uint64_t* dstPixel = (uint64_t*)&dst[i*8];
+            uint64_t* srcPixel = (uint64_t*)&src[(count - i - 1)*8];
+            *dstPixel = *srcPixel;
+        }
+    }
+    
+    void mirror_a8(unsigned char* src, unsigned char* dst, size_t count) {
+        for(size_t i = 0; i < count; ++i)
+            dst[i] = src[count - i - 1];
+    }
+    
     void mirror_pixels(unsigned char* src, unsigned char* dst, size_t count, size_t bpp) {
         switch (bpp) {
+            case 8:
+                mirror_rgba16(src, dst, count);
+                break;
             case 4:
                 mirror_rgba8(src, dst, count);
                 break;
             case 2:
                 mirror_rgba4(src, dst, count);
                 break;
+            case 1:
+                mirror_a8(src, dst, count);
+                break;
             default:
                 // For other bpp
                 for(size_t i = 0; i < count; ++i) {
@@ -90,6 +113,42 @@ namespace {
         }
     }
 
+    void premultiple_rgba16(unsigned char* src, unsigned char* dst, size_t count) {
+        uint16_t const* in = (uint16_t const*)src;
+        uint16_t* out = (uint16_t*)dst;
+        
+        for(size_t i = 0; i < count * 4; i += 4) {
+            const uint32_t alpha = in[i + 3];
+            out[i + 0] = (uint16_t)((in[i + 0] * alpha + 32767) / 65535);
+            out[i + 1] = (uint16_t)((in[i + 1] * alpha + 32767) / 65535);
+            out[i + 2] = (uint16_t)((in[i + 2] * alpha + 32767) / 65535);
+            out[i + 3] = (uint16_t)alpha;
+        }
+    }
+    
+    /// Pixels of half float rows are processed by chunks of floats on the stack
+    const size_t half_chunk_pixels = 256;
+    
+    void premultiple_rgba16f(unsigned char* src, unsigned char* dst, size_t count) {
+        float buffer[half_chunk_pixels * 4];
+        uint16_t const* in = (uint16_t const*)src;
+        uint16_t* out = (uint16_t*)dst;
+        
+        for(size_t done = 0; done < count; done += half_chunk_pixels) {
+            const size_t chunk = (std::min)(half_chunk_pixels, count - done);
+            details::halves_to_floats(&in[done * 4], buffer, chunk * 4);
+            
+            for(size_t i = 0; i < chunk * 4; i += 4) {
+                const float alpha = buffer[i + 3];
+                buffer[i + 0] *= alpha;
+                buffer[i + 1] *= alpha;
+                buffer[i + 2] *= alpha;
+            }
+            
+            details::floats_to_halves(buffer, &out[done * 4], chunk * 4);
+        }
+    }
+
     void rgb8_to_rgba8(unsigned char* src, unsigned char* dst, size_t count) {
         const unsigned char alpha = 0xff;
         for(size_t i = 0; i < count; ++i) {
@@ -115,6 +174,110 @@ namespace {
         }
     }
 
+    void rgba8_to_rgb565(unsigned char* src, unsigned char* dst, size_t count) {
+        uint32_t* inPixel32 = (uint32_t*)src;
+        uint16_t* outPixel16 = (uint16_t*)dst;
+        
+        for(unsigned int i = 0; i < count; ++i, ++inPixel32) {
+            *outPixel16++ =
+            ((((*inPixel32 >> 0) & 0xFF) >> 3) << 11) | // R
+            ((((*inPixel32 >> 8) & 0xFF) >> 2) <<  5) | // G
+            ((((*inPixel32 >> 16) & 0xFF) >> 3) << 0);  // B
+        }
+    }
+
+    void rgba8_to_rgb8(unsigned char* src, unsigned char* dst, size_t count) {
+        for(size_t i = 0; i < count; ++i) {
+            auto index3 = i * 3;
+            auto index4 = i * 4;
+            dst[index3] = src[index4];
+            dst[index3 + 1] = src[index4 + 1];
+            dst[index3 + 2] = src[index4 + 2];
+        }
+    }
+
+    void rgba8_to_a8(unsigned char* src, unsigned char* dst, size_t count) {
+        for(size_t i = 0; i < count; ++i)
+            dst[i] = src[i * 4 + 3];
+    }
+
+    void a8_to_rgba8(unsigned char* src, unsigned char* dst, size_t count) {
+        uint32_t* outPixel32 = (uint32_t*)dst;
+        for(size_t i = 0; i < count; ++i)
+            outPixel32[i] = 0x00FFFFFFu | ((uint32_t)src[i] << 24);
+    }
+
+    void rgba8_to_rgba16(unsigned char* src, unsigned char* dst, size_t count) {
+        uint16_t* out = (uint16_t*)dst;
+        for(size_t i = 0; i < count * 4; ++i)
+            out[i] = (uint16_t)(src[i] * 257);
+    }
+    
+    void rgba16_to_rgba8(unsigned char* src, unsigned char* dst, size_t count) {
+        uint16_t const* in = (uint16_t const*)src;
+        for(size_t i = 0; i < count * 4; ++i)
+            dst[i] = (unsigned char)((in[i] * 255u + 32767) / 65535);
+    }
+    
+    void rgba16_to_rgba16f(unsigned char* src, unsigned char* dst, size_t count) {
+        float buffer[half_chunk_pixels * 4];
+        uint16_t const* in = (uint16_t const*)src;
+        uint16_t* out = (uint16_t*)dst;
+        
+        for(size_t done = 0; done < count; done += half_chunk_pixels) {
+            const size_t chunk = (std::min)(half_chunk_pixels, count - done);
+            for(size_t i = 0; i < chunk * 4; ++i)
+                buffer[i] = in[done * 4 + i] * (1.0f / 65535.0f);
+            
+            details::floats_to_halves(buffer, &out[done * 4], chunk * 4);
+        }
+    }
+    
+    void rgba16f_to_rgba16(unsigned char* src, unsigned char* dst, size_t count) {
+        float buffer[half_chunk_pixels * 4];
+        uint16_t const* in = (uint16_t const*)src;
+        uint16_t* out = (uint16_t*)dst;
+        
+        for(size_t done = 0; done < count; done += half_chunk_pixels) {
+            const size_t chunk = (std::min)(half_chunk_pixels, count - done);
+            details::halves_to_floats(&in[done * 4], buffer, chunk * 4);
+            
+            for(size_t i = 0; i < chunk * 4; ++i) {
+                // HDR values are clamped to the unsigned normalized range, NaN becomes 0
+                const float v = buffer[i] > 0.0f ? (std::min)(buffer[i], 1.0f) : 0.0f;
+                out[done * 4 + i] = (uint16_t)(v * 65535.0f + 0.5f);
+            }
+        }
+    }
+    
+    void rgba8_to_rgba16f(unsigned char* src, unsigned char* dst, size_t count) {
+        float buffer[half_chunk_pixels * 4];
+        uint16_t* out = (uint16_t*)dst;
+        
+        for(size_t done = 0; done < count; done += half_chunk_pixels) {
+            const size_t chunk = (std::min)(half_chunk_pixels, count - done);
+            for(size_t i = 0; i < chunk * 4; ++i)
+                buffer[i] = src[done * 4 + i] * (1.0f / 255.0f);
+            
+            details::floats_to_halves(buffer, &out[done * 4], chunk * 4);
+        }
+    }
+    
+    void rgba16f_to_rgba8(unsigned char* src, unsigned char* dst, size_t count) {
+        float buffer[half_chunk_pixels * 4];
+        uint16_t const* in = (uint16_t const*)src;
+        
+        for(size_t done = 0; done < count; done += half_chunk_pixels) {
+            const size_t chunk = (std::min)(half_chunk_pixels, count - done);
+            details::halves_to_floats(&in[done * 4], buffer, chunk * 4);
+            
+            for(size_t i = 0; i < chunk * 4; ++i) {
+                const float v = buffer[i] > 0.0f ? (std::min)(buffer[i], 1.0f) : 0.0f;
+                dst[done * 4 + i] = (unsigned char)(v * 255.0f + 0.5f);
+            }
+        }
+    }
+
     void rgba8_to_alpha_grayscale(unsigned char* src, unsigned char* dst, size_t count) {
         uint32_t* inPixel32 = (uint32_t*)src;
         uint16_t* outPixel16 = (uint16_t*)dst;
@@ -173,6 +336,26 @@ namespace {
                 .set_dst_format(pixel_format::rgba4)
                 .set_callback(&rgba8_to_rgba4)
             },
+            {graph_entry::properties()
+                .set_src_format(pixel_format::rgba8)
+                .set_dst_format(pixel_format::rgb565)
+                .set_callback(&rgba8_to_rgb565)
+            },
+            {graph_entry::properties()
+                .set_src_format(pixel_format::rgba8)
+                .set_dst_format(pixel_format::rgb8)
+                .set_callback(&rgba8_to_rgb8)
+            },
+            {graph_entry::properties()
+                .set_src_format(pixel_format::rgba8)
+                .set_dst_format(pixel_format::a8)
+                .set_callback(&rgba8_to_a8)
+            },
+            {graph_entry::properties()
+                .set_src_format(pixel_format::a8)
+                .set_dst_format(pixel_format::rgba8)
+                .set_callback(&a8_to_rgba8)
+            },
             /*{graph_entry::properties()
                 .set_src_format(pixel_format::rgba8)
                 .set_dst_format(pixel_format::ai8)
@@ -183,6 +366,36 @@ namespace {
                 .set_dst_format(pixel_format::rgba8)
                 .set_callback(&rgb8_to_rgba8)
             },
+            {graph_entry::properties()
+                .set_src_format(pixel_format::rgba8)
+                .set_dst_format(pixel_format::rgba16)
+                .set_callback(&rgba8_to_rgba16)
+            },
+            {graph_entry::properties()
+                .set_src_format(pixel_format::rgba8)
+                .set_dst_format(pixel_format::rgba16f)
+                .set_callback(&rgba8_to_rgba16f)
+            },
+            {graph_entry::properties()
+                .set_src_format(pixel_format::rgba16)
+                .set_dst_format(pixel_format::rgba8)
+                .set_callback(&rgba16_to_rgba8)
+            },
+            {graph_entry::properties()
+                .set_src_format(pixel_format::rgba16)
+                .set_dst_format(pixel_format::rgba16f)
+                .set_callback(&rgba16_to_rgba16f)
+            },
+            {graph_entry::properties()
+                .set_src_format(pixel_format::rgba16f)
+                .set_dst_format(pixel_format::rgba8)
+                .set_callback(&rgba16f_to_rgba8)
+            },
+            {graph_entry::properties()
+                .set_src_format(pixel_format::rgba16f)
+                .set_dst_format(pixel_format::rgba16)
+                .set_callback(&rgba16f_to_rgba16)
+            },
         };
         
         return g;
@@ -217,7 +430,10 @@ namespace {
                 break;
             
             auto next_childs = graph.equal_range(graph_entry(details.dst_format()));
-            if(next_childs.first == node)
+            bool is_visited = any_of(traverse.begin(), traverse.end(), [&](range const& r){
+                return r.first->src_format() == details.dst_format();
+            });
+            if(is_visited)
                 // Prevent loops
                 next_childs.first = next_childs.second = graph.end();
             
@@ -236,21 +452,124 @@ namespace {
         return path;
     }
     
-    pixel_converter_ptr create_format_converter(pixel_format src_fmt,
-                                                pixel_format dst_fmt,
-                                                size_t pixels_count,
-                                                bool premultiple)
+    /// Returns the path through the conversion graph, the same format is just copied
+    /// The same formats are copied as is and a direct step is preferred to a chain of them,
+    /// so no precision is lost in intermediate formats
+    vector<graph_entry> find_plain_path(pixel_format src, pixel_format dst) {
+        if(src == dst && src != pixel_format::unknown) {
+            int bpp = pixel_format_details(src).bpp;
+            return {graph_entry(graph_entry::properties()
+                                .set_src_format(src)
+                                .set_dst_format(dst)
+                                .set_callback(bind(&copy_pixels, bpp, placeholders::_1, placeholders::_2, placeholders::_3)))};
+        }
+        
+        convgraph const& graph = conversion_graph();
+        auto steps = graph.equal_range(graph_entry(src));
+        auto direct = find_if(steps.first, steps.second, [&](graph_entry const& e){
+            return e.dst_format() == dst;
+        });
+        if(direct != steps.second)
+            return {*direct};
+        
+        return find_conversion_path(src, dst);
+    }
+    
+    bool same_palettes(palette_ptr const& a, palette_ptr const& b) {
+        return a == b || (a && b && a->colors == b->colors);
+    }
+    
+    /// Palette-indexed formats are converted through rgba8 using the palettes of the params.
+    /// The palette mapper reads the destination position from <origin>.
+    vector<graph_entry> find_path(converter_params const& params, shared_ptr<offset const> origin) {
+        const auto src = params.src_fmt;
+        const auto dst = params.dst_fmt;
+        const auto p8 = pixel_format::p8;
+        const auto rgba8 = pixel_format::rgba8;
+        const auto src_palette = params.src_palette ? params.src_palette : params.palette;
+        
+        // Indices are copied as is only if they refer to the same colors
+        if(src != p8 && dst != p8)
+            return find_plain_path(src, dst);
+        if(src == dst && same_palettes(src_palette, params.palette))
+            return find_plain_path(src, dst);
+        
+        vector<graph_entry> path;
+        if(src == p8) {
+            auto expander = details::create_palette_expander(src_palette);
+            if(!expander)
+                return {};
+            
+            path.push_back(graph_entry(graph_entry::properties()
+                                       .set_src_format(p8)
+                                       .set_dst_format(rgba8)
+                                       .set_callback(expander)));
+        }
+        else if(src != rgba8) {
+            path = find_plain_path(src, rgba8);
+            if(path.empty())
+                return {};
+        }
+        
+        if(dst == p8) {
+            auto mapper = details::create_palette_mapper(params.palette, params.dithering, origin);
+            if(!mapper)
+                return {};
+            
+            path.push_back(graph_entry(graph_entry::properties()
+                                       .set_src_format(rgba8)
+                                       .set_dst_format(p8)
+                                       .set_callback(mapper)));
+        }
+        else if(dst != rgba8) {
+            auto tail = find_plain_path(rgba8, dst);
+            if(tail.empty())
+                return {};
+            
+            path.insert(path.end(), tail.begin(), tail.end());
+        }
+        
+        return path;
+    }
+    
+    pixel_converter_ptr create_format_converter(converter_params const& params)
     {
-        auto converters = find_conversion_path(src_fmt, dst_fmt);
-        if(!converters.empty() && premultiple && converters[0].src_format() == pixel_format::rgba8) {
-            // add premultiple stage
-            auto props = converters[0].props();
-            props.dst_format = props.src_format;
-            props.cb = &premultiple_rgba8;
+        auto origin = make_shared<offset>(0, 0);
+        auto converters = find_path(params, origin);
+        if(converters.empty())
+            return nullptr;
+        
+        if(params.premultiple) {
+            auto has_alpha = [](pixel_format fmt) {
+                return (fmt == pixel_format::rgba8 ||
+                        fmt == pixel_format::rgba16 ||
+                        fmt == pixel_format::rgba16f);
+            };
+            
+            // add premultiple stage in front of the first step having the alpha channel,
+            // or behind the last one if only its output has it (e.g. the palette expander)
+            auto first_rgba = find_if(converters.begin(), converters.end(), [&](graph_entry const& e){
+                return has_alpha(e.src_format());
+            });
             
-            converters.insert(converters.begin(), graph_entry(props));
+            pixel_format fmt = (first_rgba != converters.end() ? first_rgba->src_format() :
+                                converters.back().dst_format());
+            if(has_alpha(fmt)) {
+                auto props = converters.back().props();
+                props.src_format = fmt;
+                props.dst_format = fmt;
+                props.cb = (fmt == pixel_format::rgba16 ? &premultiple_rgba16 :
+                            fmt == pixel_format::rgba16f ? &premultiple_rgba16f :
+                            &premultiple_rgba8);
+                
+                converters.insert(first_rgba, graph_entry(props));
+            }
         }
         
+        const auto dst_fmt = params.dst_fmt;
+        const auto src_fmt = params.src_fmt;
+        const auto pixels_count = params.pixels_count;
+        
         // Select the highest bpp of convertion path
         int bpp = pixel_format_details(dst_fmt).bpp;
         for(auto const& details : converters)
@@ -264,15 +583,19 @@ namespace {
         const int BUFFERS_COUNT = 2;
         const int MIN_STEPS_FOR_BUFFERING = 2;
 
-        std::array<buffer_ptr, 2> buffers;
-        if(converters.size() == MIN_STEPS_FOR_BUFFERING) {
+        std::array<buffer_ptr, BUFFERS_COUNT> buffers;
+        if(converters.size() >= MIN_STEPS_FOR_BUFFERING) {
             // We are needed buffering only when there are at least 2 conversion steps.
-            buffers[0].reset((unsigned char*)std::malloc(buffer_size), [](unsigned char* buff){ std::free(buff);});
+            buffers[0] = details::allocate_tracked(buffer_size, params.memory_account);
+            if(!buffers[0] && buffer_size)
+                return nullptr;
         }
         
         if(converters.size() > MIN_STEPS_FOR_BUFFERING) {
             // We are needed the second buffer only when there are 3 or more conversion steps.
-            buffers[1].reset((unsigned char*)std::malloc(buffer_size), [](unsigned char* buff){ std::free(buff);});
+            buffers[1] = details::allocate_tracked(buffer_size, params.memory_account);
+            if(!buffers[1] && buffer_size)
+                return nullptr;
         }
         
         auto const& max_pixels_count = pixels_count;
@@ -294,7 +617,7 @@ namespace {
                 input_buff = output_buff;
                 
                 // Roll the buffers
-                if(++next_buffer_id > BUFFERS_COUNT)
+                if(++next_buffer_id >= BUFFERS_COUNT)
                     next_buffer_id = 0;
             }
             
@@ -303,7 +626,8 @@ namespace {
         return make_shared<pixel_converter>(pixel_converter::properties()
                                             .set_src_format(src_fmt)
                                             .set_dst_format(dst_fmt)
-                                            .set_callback(convert_fn));
+                                            .set_callback(convert_fn)
+                                            .set_row_callback([origin](int y, int x){ *origin = offset(x, y); }));
     }
 
 } // namespace
@@ -311,10 +635,7 @@ namespace {
 pixel_converter_ptr atlas2d::create_pixel_converter(converter_params const& params) {
     
     // Here we need a data converter
-    pixel_converter_ptr converter = create_format_converter(params.src_fmt,
-                                                            params.dst_fmt,
-                                                            params.pixels_count,
-                                                            params.premultiple);
+    pixel_converter_ptr converter = create_format_converter(params);
     if(!converter) {
         // No situable converter found
         return nullptr;
@@ -341,6 +662,7 @@ pixel_converter_ptr atlas2d::create_pixel_converter(converter_params const& para
     
     return make_shared<pixel_converter>(pixel_converter::properties()
                                         .set_callback(convert_and_mirror)
+                                        .set_row_callback([converter, margins](int y, int x){ converter->set_row(y, x + (int)margins[0]); })
                                         .set_src_format(params.src_fmt)
                                         .set_dst_format(params.dst_fmt));
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "forwards.hpp"
 #include "pixel_format.hpp"
 #include <functional>
 #include <array>
@@ -16,6 +17,11 @@ namespace atlas2d {
         size_t pixels_count;            ///< Pixels count
         std::array<size_t,2> margins;   ///< Destination buffer's extra pixels (left and right side)
         bool premultiple = false;       ///< Premultiple each pixel with it's alpha channel
+        palette_ptr palette;            ///< Color table when one of the formats is palette-indexed
+                                        ///< (the destination's one when both are)
+        palette_ptr src_palette;        ///< Color table of a palette-indexed source, <palette> is used if it's empty
+        bool dithering = false;         ///< Ordered dithering while mapping colors to the palette
+        memory_account_ptr memory_account;  ///< Account to charge the scratch buffers to
     };
     
     // Helper
@@ -26,9 +32,14 @@ namespace atlas2d {
         self& set_pixels_count(size_t const& arg) {pixels_count=arg; return *this;}
         self& set_margins(size_t left, size_t right=0) {margins[0]=left; margins[1]=right; return *this;}
         self& enable_premultiple(bool arg=true) {premultiple=arg; return *this;}
+        self& set_palette(palette_ptr arg) {palette=std::move(arg); return *this;}
+        self& set_src_palette(palette_ptr arg) {src_palette=std::move(arg); return *this;}
+        self& enable_dithering(bool arg=true) {dithering=arg; return *this;}
+        self& set_memory_account(memory_account_ptr arg) {memory_account=std::move(arg); return *this;}
     };
     
-    /// Creates a converter to convert pixels of <src_fmt> format to <dst_fmt> pixel format
+    /// Creates a converter to convert pixels of <src_fmt> format to <dst_fmt> pixel format.
+    /// Returns nullptr if there is no conversion path or the scratch buffers exceed the memory budget.
     pixel_converter_ptr create_pixel_converter(converter_params const& params);
 
     
@@ -37,6 +48,7 @@ namespace atlas2d {
     protected:
         struct basic_props {
             std::function<void(unsigned char*, unsigned char*, size_t)> cb;
+            std::function<void(int, int)> row_cb;
             pixel_format src_format;
             pixel_format dst_format;
         };
@@ -46,6 +58,7 @@ namespace atlas2d {
         
         struct properties: basic_props {
             properties& set_callback(callback arg) {cb = std::move(arg); return *this;}
+            properties& set_row_callback(std::function<void(int, int)> arg) {row_cb = std::move(arg); return *this;}
             properties& set_src_format(pixel_format fmt) {src_format = fmt; return *this;}
             properties& set_dst_format(pixel_format fmt) {dst_format = fmt; return *this;}
         };
@@ -66,6 +79,13 @@ namespace atlas2d {
             _props.cb(src_pixels, dst_pixels, pixels_count);
         }
         
+        /// Sets the destination row and column of the pixels converted next, the dithering is aligned to them.
+        /// <x> is the column of the first pixel of the destination buffer, margins included.
+        void set_row(int row, int x = 0) const {
+            if(_props.row_cb)
+                _props.row_cb(row, x);
+        }
+        
         /// Return converter's properties
         basic_props const& props() const {
             return _props;
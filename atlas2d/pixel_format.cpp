@@ -40,6 +40,10 @@ namespace {
         format_item().set_format(pixel_format::rgb8).set_name("rgb8").set_bpp(3),
         format_item().set_format(pixel_format::rgba8).set_name("rgba8").set_bpp(4),
         format_item().set_format(pixel_format::rgba4).set_name("rgba4").set_bpp(2),
+        format_item().set_format(pixel_format::p8).set_name("p8").set_bpp(1),
+        format_item().set_format(pixel_format::a8).set_name("a8").set_bpp(1),
+        format_item().set_format(pixel_format::rgba16).set_name("rgba16").set_bpp(8),
+        format_item().set_format(pixel_format::rgba16f).set_name("rgba16f").set_bpp(8),
     };
     
     /// The invalid value
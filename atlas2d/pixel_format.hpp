@@ -12,6 +12,10 @@ namespace atlas2d {
         rgb565,
         rgba8,
         rgba4,
+        p8,         ///< Palette-indexed, needs a palette attached to the area
+        a8,         ///< Single channel (alpha, mask or distance field)
+        rgba16,     ///< 16 bits unsigned normalized per channel
+        rgba16f,    ///< 16 bits half float per channel
     };
     
     /// Format details
@@ -0,0 +1,183 @@
+#include "pixel_layout.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+using namespace ::atlas2d;
+using namespace ::atlas2d::details;
+
+namespace {
+    
+    bool is_power_of_two(size_t v) {
+        return v && !(v & (v - 1));
+    }
+    
+    size_t log2_of(size_t v) {
+        size_t shift = 0;
+        while((size_t(1) << shift) < v)
+            ++shift;
+        return shift;
+    }
+    
+    /// Walks through a row segment of a morton tiled image.
+    /// The x bits are advanced by the masked increment instead of interleaving every coordinate.
+    template<size_t BPP, bool IS_WRITE>
+    void walk_morton(unsigned char* data,
+                     unsigned char* pixels,
+                     size_t count,
+                     int x, int y,
+                     size_t tile_shift,
+                     size_t tiles_x)
+    {
+        const uint32_t tile_mask = (uint32_t)((size_t(1) << tile_shift) - 1);
+        const uint32_t x_mask = spread_bits(tile_mask);
+        const uint32_t y_bits = spread_bits((uint32_t)y & tile_mask) << 1;
+        const size_t tile_pixels = size_t(1) << (2 * tile_shift);
+        const size_t tile_row_base = ((size_t)y >> tile_shift) * tiles_x;
+        
+        size_t tx = (size_t)x >> tile_shift;
+        uint32_t x_bits = spread_bits((uint32_t)x & tile_mask);
+        unsigned char* tile = &data[(tile_row_base + tx) * tile_pixels * BPP];
+        
+        for(size_t i = 0; i < count; ++i) {
+            unsigned char* pixel = &tile[(size_t)(x_bits | y_bits) * BPP];
+            if(IS_WRITE)
+                std::memcpy(pixel, &pixels[i * BPP], BPP);
+            else
+                std::memcpy(&pixels[i * BPP], pixel, BPP);
+            
+            x_bits = ((x_bits | ~x_mask) + 1) & x_mask;
+            if(!x_bits) {
+                // Step to the next tile
+                ++tx;
+                tile = &data[(tile_row_base + tx) * tile_pixels * BPP];
+            }
+        }
+    }
+    
+    template<bool IS_WRITE>
+    void walk_morton(size_t bpp,
+                     unsigned char* data,
+                     unsigned char* pixels,
+                     size_t count,
+                     int x, int y,
+                     size_t tile_shift,
+                     size_t tiles_x)
+    {
+        switch(bpp) {
+            case 1: walk_morton<1, IS_WRITE>(data, pixels, count, x, y, tile_shift, tiles_x); break;
+            case 2: walk_morton<2, IS_WRITE>(data, pixels, count, x, y, tile_shift, tiles_x); break;
+            case 3: walk_morton<3, IS_WRITE>(data, pixels, count, x, y, tile_shift, tiles_x); break;
+            case 4: walk_morton<4, IS_WRITE>(data, pixels, count, x, y, tile_shift, tiles_x); break;
+            case 8: walk_morton<8, IS_WRITE>(data, pixels, count, x, y, tile_shift, tiles_x); break;
+            default: break;
+        }
+    }
+    
+} // namespace
+
+
+layout_addressing::layout_addressing(pixel_layout layout, size dims, int bpp, int tile_size)
+: _layout(layout)
+, _bpp((size_t)bpp)
+{
+    if(bpp <= 0 || dims.width < 0 || dims.height < 0)
+        return;
+    
+    _row_stride = (size_t)dims.width * _bpp;
+    if(layout == pixel_layout::linear) {
+        _data_size = _row_stride * (size_t)dims.height;
+        _valid = true;
+        return;
+    }
+    
+    // Both of the tiled layouts use shifts, the morton one interleaves 16 bits at most
+    if(tile_size <= 0 || !is_power_of_two((size_t)tile_size) || tile_size > 0x10000)
+        return;
+    
+    if(layout == pixel_layout::morton && bpp != 1 && bpp != 2 && bpp != 3 && bpp != 4 && bpp != 8)
+        return;
+    
+    _tile_size = (size_t)tile_size;
+    _tile_shift = log2_of(_tile_size);
+    _tile_bytes = _tile_size * _tile_size * _bpp;
+    _tiles_x = ((size_t)dims.width + _tile_size - 1) >> _tile_shift;
+    
+    size_t tiles_y = ((size_t)dims.height + _tile_size - 1) >> _tile_shift;
+    _data_size = _tiles_x * tiles_y * _tile_bytes;
+    _valid = true;
+}
+
+size_t layout_addressing::offset_of(int x, int y) const {
+    if(_layout == pixel_layout::linear)
+        return (size_t)y * _row_stride + (size_t)x * _bpp;
+    
+    const size_t mask = _tile_size - 1;
+    const size_t tile = ((size_t)y >> _tile_shift) * _tiles_x + ((size_t)x >> _tile_shift);
+    const size_t lx = (size_t)x & mask;
+    const size_t ly = (size_t)y & mask;
+    
+    size_t in_tile = _layout == pixel_layout::morton
+        ? morton_index((uint32_t)lx, (uint32_t)ly)
+        : (ly << _tile_shift) + lx;
+    
+    return tile * _tile_bytes + in_tile * _bpp;
+}
+
+std::pair<size_t, size_t> layout_addressing::range_of(int x, int y, size_t count) const {
+    if(!count)
+        return std::make_pair(offset_of(x, y), (size_t)0);
+    
+    if(_layout == pixel_layout::linear)
+        return std::make_pair(offset_of(x, y), count * _bpp);
+    
+    // The tiles of a tiles row are adjacent in memory
+    const size_t tile_row = ((size_t)y >> _tile_shift) * _tiles_x;
+    const size_t first = tile_row + ((size_t)x >> _tile_shift);
+    const size_t last = tile_row + (((size_t)x + count - 1) >> _tile_shift);
+    
+    return std::make_pair(first * _tile_bytes, (last - first + 1) * _tile_bytes);
+}
+
+void layout_addressing::scatter(unsigned char* data, int x, int y, unsigned char const* src, size_t count) const {
+    if(_layout == pixel_layout::linear) {
+        std::memcpy(&data[offset_of(x, y)], src, count * _bpp);
+        return;
+    }
+    
+    if(_layout == pixel_layout::morton) {
+        walk_morton<true>(_bpp, data, const_cast<unsigned char*>(src), count, x, y, _tile_shift, _tiles_x);
+        return;
+    }
+    
+    // Copy by the parts of the row that belong to the same tile
+    while(count) {
+        size_t in_tile = (std::min)(count, _tile_size - ((size_t)x & (_tile_size - 1)));
+        std::memcpy(&data[offset_of(x, y)], src, in_tile * _bpp);
+        
+        src += in_tile * _bpp;
+        x += (int)in_tile;
+        count -= in_tile;
+    }
+}
+
+void layout_addressing::gather(unsigned char const* data, int x, int y, unsigned char* dst, size_t count) const {
+    if(_layout == pixel_layout::linear) {
+        std::memcpy(dst, &data[offset_of(x, y)], count * _bpp);
+        return;
+    }
+    
+    if(_layout == pixel_layout::morton) {
+        walk_morton<false>(_bpp, const_cast<unsigned char*>(data), dst, count, x, y, _tile_shift, _tiles_x);
+        return;
+    }
+    
+    while(count) {
+        size_t in_tile = (std::min)(count, _tile_size - ((size_t)x & (_tile_size - 1)));
+        std::memcpy(dst, &data[offset_of(x, y)], in_tile * _bpp);
+        
+        dst += in_tile * _bpp;
+        x += (int)in_tile;
+        count -= in_tile;
+    }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "forwards.hpp"
+
+#include <cstdint>
+#include <utility>
+
+namespace atlas2d {
+    
+    /// Order of pixels in an image's memory
+    enum class pixel_layout {
+        linear,     ///< Row-major order
+        tiled,      ///< Row-major tiles of tile_size x tile_size, row-major pixels inside a tile
+        morton,     ///< Row-major tiles of tile_size x tile_size, Z-order pixels inside a tile
+    };
+    
+    namespace details {
+        
+        /// Spreads the low 16 bits of <v> to the even bits
+        inline uint32_t spread_bits(uint32_t v) {
+            v &= 0x0000FFFF;
+            v = (v | (v << 8)) & 0x00FF00FF;
+            v = (v | (v << 4)) & 0x0F0F0F0F;
+            v = (v | (v << 2)) & 0x33333333;
+            v = (v | (v << 1)) & 0x55555555;
+            return v;
+        }
+        
+        /// Interleaves bits of x and y: x takes the even bits, y takes the odd ones
+        inline uint32_t morton_index(uint32_t x, uint32_t y) {
+            return spread_bits(x) | (spread_bits(y) << 1);
+        }
+        
+        /// Maps pixel coordinates of an image to offsets in its memory
+        class layout_addressing {
+        public:
+            layout_addressing() { ;; }
+            
+            /// <tile_size> has to be a power of two for the morton layout
+            layout_addressing(pixel_layout layout, size dims, int bpp, int tile_size);
+            
+            /// Returns true if the layout parameters are usable
+            bool is_valid() const { return _valid; }
+            
+            /// Returns true for the row-major layout
+            bool is_linear() const { return _layout == pixel_layout::linear; }
+            
+            /// Returns the size of the memory the image needs
+            size_t data_size() const { return _data_size; }
+            
+            /// Returns the offset of the pixel in bytes
+            size_t offset_of(int x, int y) const;
+            
+            /// Returns [offset, offset + bytes) range covering a row segment of <count> pixels
+            std::pair<size_t, size_t> range_of(int x, int y, size_t count) const;
+            
+            /// Writes <count> pixels of the row segment starting at (x, y)
+            void scatter(unsigned char* data, int x, int y, unsigned char const* src, size_t count) const;
+            
+            /// Reads <count> pixels of the row segment starting at (x, y)
+            void gather(unsigned char const* data, int x, int y, unsigned char* dst, size_t count) const;
+            
+        private:
+            pixel_layout _layout = pixel_layout::linear;
+            size_t _bpp = 0;
+            size_t _row_stride = 0;
+            size_t _tile_size = 0;
+            size_t _tile_shift = 0;
+            size_t _tile_bytes = 0;
+            size_t _tiles_x = 0;
+            size_t _data_size = 0;
+            bool _valid = false;
+        };
+        
+    } // namespace details
+    
+} // namespace atlas2d
@@ -1,35 +1,25 @@
 #include "raw_image.hpp"
 #include "pixel_format.hpp"
 #include "pixel_converter.hpp"
+#include "memory_budget.hpp"
+#include "sparse_storage.hpp"
+#include "compressed_storage.hpp"
+#include "channel_pack.hpp"
 
 #include <cstring>
+#include <chrono>
+#include <atomic>
 
 using namespace ::atlas2d;
 
 namespace {
     /// Allocates an pixels buffer
-    raw_data_ptr allocate_data(raw_image_props const& props) {
-        auto bpp = pixel_format_details(props.format).bpp;
-        
-        size_t dataSize = (size_t)(props.dimensions.width * props.dimensions.height * bpp);
+    raw_data_ptr allocate_data(size_t dataSize, bool wipe_data, memory_account_ptr const& account) {
         if(!dataSize) {
             return nullptr;
         }
         
-        auto data = raw_data_ptr((unsigned char*)malloc(dataSize), [](unsigned char* ptr){free(ptr);});
-        if(props.wipe_data)
-            memset(data.get(), 0, dataSize);
-        
-        return data;
-    }
-    
-    /// Calculates pixel's index of the area by its (x, y) coordinates.
-    size_t pixel_index_of(pixel_area const& area, int x, int y) {
-        // TODO: here is a bottleneck. Optimize it in future.
-        auto dims = area.get_dimensions();
-        auto bpp = pixel_format_details(area.get_pixel_format()).bpp;
-        
-        return (y * dims.width + x) * bpp;
+        return details::allocate_tracked(dataSize, account, wipe_data);
     }
 }
 
@@ -37,8 +27,33 @@ bool raw_image::fill_image(pixel_area const& pixels, image_filling_props const&
     auto const& filling_props = dynamic_cast<raw_image_filling_props const&>(base_props);
     auto const& src_area = dynamic_cast<raw_pixel_area const&>(pixels);
     
-    if(!_props.data)
-        _props.data = allocate_data(_props);
+    auto recorder = _recorder;
+    if(!recorder)
+        return fill_pixels(src_area, filling_props);
+    
+    auto started = std::chrono::steady_clock::now();
+    bool result = fill_pixels(src_area, filling_props);
+    auto elapsed = std::chrono::steady_clock::now() - started;
+    
+    recorder->record(*this,
+                     src_area,
+                     filling_props,
+                     result,
+                     (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    return result;
+}
+
+void raw_image::set_fill_recorder(fill_recorder_ptr recorder) {
+    _recorder = std::move(recorder);
+}
+
+uint64_t raw_image::get_generation() const {
+    return _generation;
+}
+
+bool raw_image::fill_pixels(raw_pixel_area const& src_area, raw_image_filling_props const& filling_props) {
+    if(!prepare_pixels())
+        return false;
     
     auto dst_size = get_dimensions();
     auto src_size = src_area.get_dimensions();
@@ -47,10 +62,11 @@ bool raw_image::fill_image(pixel_area const& pixels, image_filling_props const&
     unsigned char* src_pixels = src_area.get_raw_pixels();
     
     auto const& at_pos = filling_props.offset_pos;
-    bool does_area_fit = (at_pos.x + src_size.width <= dst_size.width &&
-                        at_pos.y + src_size.height <= dst_size.height);
+    bool does_area_fit = (at_pos.x >= 0 && at_pos.y >= 0 &&
+                          at_pos.x + src_size.width <= dst_size.width &&
+                          at_pos.y + src_size.height <= dst_size.height);
     
-    if(!src_pixels || !dst_pixels || !does_area_fit)
+    if(!src_pixels || !does_area_fit)
         return false;
     
     int padding_between_sprites = _props.padding_between_sprites;
@@ -71,55 +87,328 @@ bool raw_image::fill_image(pixel_area const& pixels, image_filling_props const&
     int bottom_margin = (std::min)(padding_between_sprites, src_size.height);
     bottom_margin = (std::min)(bottom_margin, dst_size.height - at_pos.y - src_size.height);
     
+    // Channel packing converts the sprite to rgba8 and inserts one of its channels to the pixels of the page
+    const int target_channel = filling_props.target_channel;
+    const int source_channel = filling_props.source_channel;
+    const bool is_packing = target_channel >= 0;
+    if(is_packing && (target_channel > 3 || source_channel < 0 || source_channel > 3 ||
+                      (get_pixel_format() != pixel_format::rgba8 && get_pixel_format() != pixel_format::rgba4)))
+        return false;
+    
+    // The channels of the unwiped pixels not packed yet would keep garbage
+    if(is_packing && _unwiped)
+        return false;
+    
+    // A palette-indexed page maps colors to its own palette, otherwise the palette of the source is used
+    auto palette = get_pixel_format() == pixel_format::p8 ? _props.palette : src_area.props().palette;
+    
     auto converter = create_pixel_converter(set_converter_params()
                                             .set_src_fmt(src_area.get_pixel_format())
-                                            .set_dst_fmt(get_pixel_format())
+                                            .set_dst_fmt(is_packing ? pixel_format::rgba8 : get_pixel_format())
                                             .set_pixels_count(src_size.width)
                                             .set_margins(left_margin, right_margin)
-                                            .enable_premultiple(filling_props.premultiple));
-
+                                            .enable_premultiple(filling_props.premultiple)
+                                            .set_palette(palette)
+                                            .set_src_palette(src_area.props().palette)
+                                            .enable_dithering(filling_props.dithering)
+                                            .set_memory_account(account()));
+    if(!converter)
+        return false;
     
     size_t bpp = pixel_format_details(converter->props().dst_format).bpp;
     size_t pixels_in_block = src_size.width + left_margin + right_margin;
+    int block_x = at_pos.x - left_margin;
     
     size_t src_bpp = pixel_format_details(converter->props().src_format).bpp;
-    raw_data_ptr src_row((unsigned char*)malloc(src_size.width * src_bpp),
-                            [](unsigned char* ptr){free(ptr);});
+    raw_data_ptr src_row = details::allocate_tracked(src_size.width * src_bpp, account());
+    if(!src_row && src_size.width)
+        return false;
+    
+    // Rows out of the clip range or out of the stored rows are skipped
+    auto stored = stored_rows();
+    const int clip_top = (std::max)(filling_props.clip_top, stored.first);
+    const int clip_bottom = (std::min)(filling_props.clip_bottom, stored.second);
+    const bool is_clipped = (at_pos.y - top_margin < clip_top ||
+                             at_pos.y + src_size.height + bottom_margin > clip_bottom);
+    
+    auto is_visible = [&](int dst_y) {
+        return dst_y >= clip_top && dst_y < clip_bottom;
+    };
     
-    for(int y = 0; y < src_size.height; ++y) {
-        size_t dst_index = pixel_index_of(*this,
-                                          at_pos.x - left_margin,
-                                          y + at_pos.y);
+    // Tiled layouts, the compressed storage, the packing and the clipping get the converted row
+    // in a buffer and store it then
+    const bool is_direct = _addressing.is_linear() && !_compressed && !is_packing && !is_clipped;
+    
+    // Tiles of a row must fit the cache of the compressed storage, otherwise every row decompresses them anew.
+    // The configured size is restored after the fill.
+    struct row_fit {
+        details::compressed_storage* storage;
+        ~row_fit() { if(storage) storage->release_row(); }
+    } fitted{nullptr};
+    if(_compressed) {
+        _compressed->fit_row(pixels_in_block);
+        fitted.storage = _compressed.get();
+    }
+    raw_data_ptr dst_row;
+    if(!is_direct) {
+        dst_row = details::allocate_tracked(pixels_in_block * bpp, account());
+        if(!dst_row && pixels_in_block)
+            return false;
+    }
+    
+    // The packed channel and the pixels of the page it's inserted to
+    raw_data_ptr plane, page_row;
+    if(is_packing) {
+        plane = details::allocate_tracked(pixels_in_block, account());
+        page_row = details::allocate_tracked(pixels_in_block * pixel_format_details(get_pixel_format()).bpp, account());
+        if((!plane || !page_row) && pixels_in_block)
+            return false;
+    }
+    
+    // A clipped fill converts only the rows which are visible themselves or have a visible mirror
+    int first_row = 0, last_row = src_size.height;
+    if(is_clipped) {
+        first_row = src_size.height;
+        last_row = 0;
+        auto take_rows = [&](int begin, int end) {
+            begin = (std::max)(begin, 0);
+            end = (std::min)(end, src_size.height);
+            if(begin < end) {
+                first_row = (std::min)(first_row, begin);
+                last_row = (std::max)(last_row, end);
+            }
+        };
+        
+        const int mirrored_y = at_pos.y + 2 * src_size.height;
+        take_rows(clip_top - at_pos.y, clip_bottom - at_pos.y);
+        take_rows(at_pos.y - clip_bottom, (std::min)(at_pos.y - clip_top, top_margin));
+        take_rows((std::max)(mirrored_y - clip_bottom, src_size.height - bottom_margin), mirrored_y - clip_top);
+    }
+    
+    for(int y = first_row; y < last_row; ++y) {
+        const int top_y = (top_margin > 0 && (y+1) <= top_margin) ? at_pos.y - y - 1 : -1;
+        const int bottom_y = ((bottom_margin > 0 && (src_size.height - y - 1) < bottom_margin) ?
+                              at_pos.y + src_size.height + (src_size.height - y - 1) : -1);
+        
+        // Nothing to convert if neither the row nor its mirrors are visible
+        if(is_clipped && !is_visible(y + at_pos.y) && !is_visible(top_y) && !is_visible(bottom_y))
+            continue;
+        
+        unsigned char* dst_block = dst_row.get();
+        if(is_direct) {
+            auto range = _addressing.range_of(block_x, storage_row(y + at_pos.y), pixels_in_block);
+            if(!commit_pixels(range.first, range.second))
+                return false;
+            dst_block = &dst_pixels[range.first];
+        }
         
         src_area.read_row(src_row.get(), y);
         unsigned char* src_block = src_row.get();
-        unsigned char* dst_block = &dst_pixels[dst_index];
         
+        converter->set_row(y + at_pos.y, block_x);
         (*converter)(src_block, dst_block, src_size.width);
         
-        // also mirror top and bottom rows
-        src_block = dst_block;
+        if(is_packing)
+            details::extract_channel_rgba8(dst_block, plane.get(), pixels_in_block, source_channel);
         
+        auto put_row = [&](int dst_y) {
+            if(!is_visible(dst_y))
+                return true;
+            if(is_packing)
+                return pack_pixels(block_x, dst_y, plane.get(), page_row.get(), pixels_in_block, target_channel);
+            return store_pixels(block_x, dst_y, dst_block, pixels_in_block);
+        };
+        
+        if(!is_direct && !put_row(y + at_pos.y))
+            return false;
+        
+        // also mirror top and bottom rows
         // the top rows
-        if(top_margin > 0 && (y+1) <= top_margin) {
-            size_t dst_index = pixel_index_of(*this,
-                                              at_pos.x - left_margin,
-                                              at_pos.y - y - 1);
-            unsigned char* dst_block = &dst_pixels[dst_index];
-            std::memcpy(dst_block, src_block, pixels_in_block * bpp);
-        }
+        if(top_y >= 0 && !put_row(top_y))
+            return false;
         
         // the bottom rows
-        if(bottom_margin > 0 && (src_size.height - y - 1) < bottom_margin) {
-            size_t dst_index = pixel_index_of(*this,
-                                              at_pos.x - left_margin,
-                                              at_pos.y + src_size.height + (src_size.height - y - 1));
-            unsigned char* dst_block = &dst_pixels[dst_index];
-            std::memcpy(dst_block, src_block, pixels_in_block * bpp);
-        }
+        if(bottom_y >= 0 && !put_row(bottom_y))
+            return false;
     }
     
+    // The modified tiles are compressed on eviction or by flush_pixels()
+    return true;
+}
+
+bool raw_image::write_row(unsigned char const* src, int x, int y, size_t count) {
+    if(!prepare_pixels())
+        return false;
+    
+    auto dims = get_dimensions();
+    auto stored = stored_rows();
+    if(x < 0 || y < stored.first || y >= stored.second || (size_t)x + count > (size_t)dims.width)
+        return false;
+    
+    return store_pixels(x, y, src, count);
+}
+
+bool raw_image::flush_pixels() {
+    return !_compressed || _compressed->flush();
+}
+
+bool raw_image::move_window(int top) {
+    if(_props.storage != raw_storage::band)
+        return false;
+    
+    _props.window_top = top;
+    if(get_raw_pixels())
+        std::memset(get_raw_pixels(), 0, _addressing.data_size());
     return true;
 }
 
+int raw_image::storage_row(int y) const {
+    return _props.storage == raw_storage::band ? y - _props.window_top : y;
+}
+
+std::pair<int, int> raw_image::stored_rows() const {
+    if(_props.storage != raw_storage::band)
+        return std::make_pair(0, get_dimensions().height);
+    
+    return std::make_pair(_props.window_top, _props.window_top + _props.window_rows);
+}
+
+bool raw_image::store_pixels(int x, int y, unsigned char const* src, size_t count) {
+    y = storage_row(y);
+    if(_compressed)
+        return _compressed->write(x, y, src, count);
+    
+    auto range = _addressing.range_of(x, y, count);
+    if(!commit_pixels(range.first, range.second))
+        return false;
+    
+    unsigned char* dst_pixels = get_raw_pixels();
+    if(_addressing.is_linear())
+        std::memcpy(&dst_pixels[range.first], src, range.second);
+    else
+        _addressing.scatter(dst_pixels, x, y, src, count);
+    return true;
+}
 
+bool raw_image::load_pixels(int x, int y, unsigned char* dst, size_t count) const {
+    y = storage_row(y);
+    if(_compressed)
+        return _compressed->read(x, y, dst, count);
+    
+    auto range = _addressing.range_of(x, y, count);
+    if(_addressing.is_linear())
+        std::memcpy(dst, &get_raw_pixels()[range.first], range.second);
+    else
+        _addressing.gather(get_raw_pixels(), x, y, dst, count);
+    return true;
+}
+
+bool raw_image::pack_pixels(int x, int y, unsigned char const* plane, unsigned char* buffer, size_t count, int channel) {
+    if(!load_pixels(x, y, buffer, count))
+        return false;
+    
+    if(get_pixel_format() == pixel_format::rgba8)
+        details::insert_channel_rgba8(buffer, plane, count, channel);
+    else
+        details::insert_channel_rgba4(buffer, plane, count, channel);
+    
+    return store_pixels(x, y, buffer, count);
+}
+
+bool raw_image::prepare_pixels() {
+    {
+        std::lock_guard<std::mutex> lock(_guard);
+        if(!_props.data && !_compressed)
+            allocate_pixels();
+    }
+    
+    return _addressing.is_valid() && (get_raw_pixels() || _compressed);
+}
+
+memory_usage raw_image::get_memory_usage() const {
+    return _account ? _account->usage() : memory_usage();
+}
+
+memory_account_ptr const& raw_image::account() {
+    return _account;
+}
+
+void raw_image::allocate_pixels() {
+    _sparse.reset();
+    _compressed.reset();
+    
+    if(!_addressing.is_valid())
+        return;
+    
+    if(_props.storage == raw_storage::compressed) {
+        // The pixels are kept by the storage only
+        _compressed = details::compressed_storage::create(_props.dimensions,
+                                                          pixel_format_details(_props.format).bpp,
+                                                          _props.tile_size,
+                                                          _props.cache_tiles,
+                                                          account());
+        return;
+    }
+    
+    if(_props.storage != raw_storage::sparse) {
+        // Rows of a band which aren't filled must read as zeros
+        bool wipe_data = _props.wipe_data || _props.storage == raw_storage::band;
+        _props.data = allocate_data(_addressing.data_size(), wipe_data, account());
+        _unwiped = !wipe_data;
+        return;
+    }
+    
+    _sparse = details::sparse_storage::reserve(_addressing.data_size(), account());
+    
+    // The data shares the ownership of the storage
+    _props.data = _sparse ? raw_data_ptr(_sparse, _sparse->data()) : nullptr;
+}
+
+bool raw_image::commit_pixels(size_t offset, size_t bytes) {
+    if(!_sparse || _sparse->data() != _props.data.get())
+        return true;
+    
+    return _sparse->commit(offset, bytes);
+}
+
+size_t raw_image::get_data_size() const {
+    return _compressed ? _compressed->compressed_size() : _addressing.data_size();
+}
+
+void raw_image::read_row(unsigned char* dst, int row) const {
+    const size_t width = (size_t)get_dimensions().width;
+    auto stored = stored_rows();
+    
+    // A page which has never been filled and the rows out of the band read as zeros
+    bool has_row = (get_raw_pixels() || _compressed) && row >= stored.first && row < stored.second;
+    if(!has_row || !load_pixels(0, row, dst, width))
+        std::memset(dst, 0, width * pixel_format_details(get_pixel_format()).bpp);
+}
+
+void raw_image::reset() {
+    base::reset();
+    
+    // The storage of the previous pixels is released, the new one is allocated on demand
+    _sparse.reset();
+    _compressed.reset();
+    _unwiped = false;
+    
+    // Every init gets a fresh account, so the new parent and limit take effect
+    _account = std::make_shared<memory_account>(_props.memory_account, _props.memory_limit);
+    
+    static std::atomic<uint64_t> generations(0);
+    _generation = ++generations;
+    
+    // The compressed storage is tiled by itself, the band one keeps linear rows of the window
+    auto layout = _props.layout;
+    auto dims = _props.dimensions;
+    if(_props.storage == raw_storage::compressed || _props.storage == raw_storage::band)
+        layout = pixel_layout::linear;
+    if(_props.storage == raw_storage::band)
+        dims.height = (std::min)(_props.window_rows, dims.height);
+    
+    _addressing = details::layout_addressing(layout,
+                                             dims,
+                                             pixel_format_details(_props.format).bpp,
+                                             _props.tile_size);
+}
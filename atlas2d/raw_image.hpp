@@ -2,16 +2,53 @@
 
 #include "raw_pixel_area.hpp"
 #include "image.hpp"
+#include "memory_budget.hpp"
+#include "pixel_layout.hpp"
+#include "fill_trace.hpp"
+
+#include <climits>
+#include <mutex>
 
 namespace atlas2d {
+    
+    namespace details {
+        class sparse_storage;
+        class compressed_storage;
+    }
 
+    /// The way pixels of an image are kept in memory
+    enum class raw_storage {
+        heap,       ///< The whole buffer is allocated at once
+        sparse,     ///< The address space is reserved, memory is committed for the touched chunks only
+        compressed, ///< Tiles are compressed one by one and decompressed on access,
+                    ///< the layout is ignored and get_raw_pixels() returns nullptr
+        band,       ///< Only the window of <window_rows> rows is kept, the rest of the page reads as zeros
+                    ///< and fills are clipped to the window. The layout is ignored.
+    };
+    
     struct raw_image_props: raw_area_props {
         bool wipe_data = false;
         int padding_between_sprites = 0;
+        raw_storage storage = raw_storage::heap;
+        pixel_layout layout = pixel_layout::linear;
+        int tile_size = 32;         ///< Tile's side of the tiled layouts (a power of two) and of the compressed storage
+        size_t cache_tiles = 64;    ///< Decompressed tiles kept by the compressed storage
+        int window_top = 0;         ///< The first row of the window of the band storage
+        int window_rows = 0;        ///< Rows count of the window of the band storage
+        memory_account_ptr memory_account;  ///< Parent account of the image's allocations (optional)
+        size_t memory_limit = 0;            ///< Max bytes the image may allocate, 0 means no limit
+                                            ///< (both are taken into account on init)
     };
     
     struct raw_image_filling_props: image_filling_props {
         bool premultiple = false;
+        bool dithering = false;     ///< Ordered dithering when the page is palette-indexed
+        int target_channel = -1;    ///< Channel (0 is R, 3 is A) of an rgba8/rgba4 page the sprite is packed to,
+                                    ///< -1 fills whole pixels. Layers sharing pixels must be filled one by one.
+                                    ///< The heap storage has to be wiped, so the channels not packed are zeros.
+        int source_channel = 3;     ///< Channel of the sprite converted to rgba8 which is packed
+        int clip_top = 0;           ///< Only page rows in [clip_top, clip_bottom) are filled, mirrored rows included
+        int clip_bottom = INT_MAX;
     };
     
     /// Represents a memory allocated raw image
@@ -26,8 +63,15 @@ namespace atlas2d {
             props& set_dims(size arg) { dimensions = std::move(arg); return *this;}
             props& set_pixel_format(pixel_format arg) { format = std::move(arg); return *this;}
             props& set_raw_data(raw_data_ptr arg) {data = std::move(arg); return *this;}
+            props& set_palette(palette_ptr arg) {palette = std::move(arg); return *this;}
             props& wipe_allocated_data(bool arg=true) {wipe_data = arg; return *this;}
             props& set_sprites_padding(int arg) {padding_between_sprites = arg; return *this;}
+            props& set_storage(raw_storage arg) {storage = arg; return *this;}
+            props& set_cache_tiles(size_t arg) {cache_tiles = arg; return *this;}
+            props& set_window(int top, int rows) {window_top = top; window_rows = rows; return *this;}
+            props& set_layout(pixel_layout arg, int tile=32) {layout = arg; tile_size = tile; return *this;}
+            props& set_memory_account(memory_account_ptr arg) {memory_account = std::move(arg); return *this;}
+            props& set_memory_limit(size_t arg) {memory_limit = arg; return *this;}
         };
         
         struct filling_props: raw_image_filling_props {
@@ -35,10 +79,84 @@ namespace atlas2d {
             
             props& set_offset(offset arg) {offset_pos = std::move(arg); return *this;}
             props& enable_premultiple(bool arg=true) {premultiple = arg; return *this;}
+            props& enable_dithering(bool arg=true) {dithering = arg; return *this;}
+            props& pack_to_channel(int target, int source=3) {target_channel = target; source_channel = source; return *this;}
+            props& clip_rows(int top, int bottom) {clip_top = top; clip_bottom = bottom; return *this;}
         };
         
+        /// Fills the image by the pixels. Returns false if the pixels don't fit, can't be converted
+        /// or the memory needed exceeds the budget. Several threads may fill the same image
+        /// while the placements (padding included) don't overlap.
         virtual bool fill_image(pixel_area const& pixels, image_filling_props const& filling_props) override;
         
+        /// Records every fill_image call to the <recorder>, nullptr stops the recording
+        void set_fill_recorder(fill_recorder_ptr recorder);
+        
+        /// Returns the id of the last init, unique among all of the images
+        uint64_t get_generation() const;
+        
+        /// Returns the memory allocated by the image (pixels and scratch buffers)
+        memory_usage get_memory_usage() const;
+        
+        /// Returns the size of the pixels buffer, tiled layouts round the dimensions up to whole tiles.
+        /// The compressed storage returns the size of the compressed tiles.
+        size_t get_data_size() const;
+        
+        /// Reads the row in the row-major order whatever the layout is
+        virtual void read_row(unsigned char* dst, int row) const override;
+        
+        /// Writes <count> pixels of the page's format at (x, y) whatever the layout is.
+        /// Returns false if the pixels don't fit or the memory needed exceeds the budget.
+        bool write_row(unsigned char const* src, int x, int y, size_t count);
+        
+        /// Compresses the tiles modified since the last call. Does nothing if the storage isn't compressed.
+        bool flush_pixels();
+        
+        /// Moves the window of the band storage to <top> and wipes it.
+        /// Returns false if the storage isn't the band one. Must not be called while filling.
+        bool move_window(int top);
+        
+    protected:
+        virtual void reset() override;
+        
+    private:
+        bool fill_pixels(raw_pixel_area const& src_area, raw_image_filling_props const& filling_props);
+        
+        /// Allocates the pixels on the first use. Returns false if there are no pixels to write to.
+        bool prepare_pixels();
+        
+        /// Returns the account of the image
+        memory_account_ptr const& account();
+        
+        /// Allocates the pixels buffer according to the storage mode
+        void allocate_pixels();
+        
+        /// Makes the range of the pixels buffer writable
+        bool commit_pixels(size_t offset, size_t bytes);
+        
+        /// Stores the row of pixels according to the storage and the layout
+        bool store_pixels(int x, int y, unsigned char const* src, size_t count);
+        
+        /// Loads the row of pixels according to the storage and the layout
+        bool load_pixels(int x, int y, unsigned char* dst, size_t count) const;
+        
+        /// Returns the row of the pixels buffer holding the row <y> of the page
+        int storage_row(int y) const;
+        
+        /// Returns the rows [top, bottom) of the page the pixels buffer holds
+        std::pair<int, int> stored_rows() const;
+        
+        /// Replaces the channel of the row of pixels by the plane, <buffer> holds <count> pixels
+        bool pack_pixels(int x, int y, unsigned char const* plane, unsigned char* buffer, size_t count, int channel);
+        
+        memory_account_ptr _account;
+        std::shared_ptr<details::sparse_storage> _sparse;
+        std::shared_ptr<details::compressed_storage> _compressed;
+        details::layout_addressing _addressing;
+        fill_recorder_ptr _recorder;
+        uint64_t _generation = 0;
+        bool _unwiped = false;      ///< The pixels are allocated on the heap and not wiped
+        std::mutex _guard;          ///< Guards the lazy allocation of the pixels
     };
     
 } // namespace atlas2d
@@ -33,14 +33,14 @@ namespace {
     };
     
     void read_row_rotated0(unsigned char* dst, row_selector const& src) {
-        size_t index = src.dims.width * src.bpp * src.row_index;
-        memcpy(dst, &src.raw_pixels[index], src.dims.width * src.bpp);
+        size_t row_size = (size_t)src.dims.width * src.bpp;
+        memcpy(dst, &src.raw_pixels[row_size * src.row_index], row_size);
     }
 
     void read_row_rotated90(unsigned char* dst, row_selector const& src) {
         // read right edge of the image as the row
         for(int i = 0; i < src.dims.height; ++i) {
-            size_t src_index = ((i + 1) * src.dims.width - 1 - src.row_index) * src.bpp;
+            size_t src_index = ((size_t)(i + 1) * src.dims.width - 1 - src.row_index) * src.bpp;
             memcpy(&dst[i * src.bpp], &src.raw_pixels[src_index], src.bpp);
         }
     }
@@ -48,7 +48,7 @@ namespace {
     void read_row_rotated180(unsigned char* dst, row_selector const& src) {
         // read starts from the bottom edge of the image in reverse order
         for(int i = 0; i < src.dims.width; ++i) {
-            size_t src_index = ((src.dims.height - src.row_index) * src.dims.width - 1 - i) * src.bpp;
+            size_t src_index = ((size_t)(src.dims.height - src.row_index) * src.dims.width - 1 - i) * src.bpp;
             memcpy(&dst[i * src.bpp], &src.raw_pixels[src_index], src.bpp);
         }
     }
@@ -56,7 +56,7 @@ namespace {
     void read_row_rotated270(unsigned char* dst, row_selector const& src) {
         // read starts from the left bottom edge of the image
         for(int i = 0; i < src.dims.height; ++i) {
-            size_t src_index = ((src.dims.height - 1 - i) * src.dims.width + src.row_index) * src.bpp;
+            size_t src_index = ((size_t)(src.dims.height - 1 - i) * src.dims.width + src.row_index) * src.bpp;
             memcpy(&dst[i * src.bpp], &src.raw_pixels[src_index], src.bpp);
         }
     }
@@ -77,6 +77,7 @@ struct raw_pixel_area_impl::pimpl {
     raw_area_props* props;
     size        orig_dims;  ///< Original dimensions of the area
     row_fetcher fetcher;    ///< Pixel row fetcher
+    rotation    rot = rotate_0_degree;
     int         bpp = 0;    ///< Bytes per pixel
 };
 
@@ -100,6 +101,7 @@ void raw_pixel_area_impl::reset() {
     _pimpl->bpp = pixel_format_details(props->format).bpp;
     _pimpl->orig_dims = props->dimensions;
     _pimpl->fetcher = &read_row_rotated0;
+    _pimpl->rot = rotate_0_degree;
 }
 
 
@@ -111,6 +113,7 @@ size raw_pixel_area_impl::get_dimensions() const {
 void raw_pixel_area_impl::set_rotator(rotation r) {
     assert(_pimpl->props && "Invalid props storage!");
     _pimpl->fetcher = fetcher_table.find(r)->second;
+    _pimpl->rot = r;
 
     _pimpl->props->dimensions = _pimpl->orig_dims;
     if(r == rotate_90_degree || r == rotate_270_degree) {
@@ -119,6 +122,10 @@ void raw_pixel_area_impl::set_rotator(rotation r) {
     }
 }
 
+raw_pixel_area_impl::rotation raw_pixel_area_impl::get_rotation() const {
+    return _pimpl->rot;
+}
+
 pixel_format raw_pixel_area_impl::get_pixel_format() const {
     return _pimpl->props->format;
 }
@@ -130,6 +137,11 @@ unsigned char* raw_pixel_area_impl::get_raw_pixels() const {
 
 
 void raw_pixel_area_impl::read_row(unsigned char* dst, int row) const {
+    if(!get_raw_pixels()) {
+        memset(dst, 0, get_dimensions().width * _pimpl->bpp);
+        return;
+    }
+    
     _pimpl->fetcher(dst,
                     row_selector()
                     .set_row_index(row)
@@ -139,3 +151,11 @@ void raw_pixel_area_impl::read_row(unsigned char* dst, int row) const {
                     );
 }
 
+pixel_analysis raw_pixel_area_impl::analyze(analysis_params const& params) const {
+    // Rows are read by the virtual read_row, so the images not having a plain buffer are analyzed too
+    return analyze_rows(get_dimensions(),
+                        get_pixel_format(),
+                        _pimpl->props->palette,
+                        [this](unsigned char* dst, int row){ read_row(dst, row); },
+                        params);
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "image.hpp"
+#include "pixel_analysis.hpp"
 
 namespace atlas2d {
     
@@ -8,6 +9,7 @@ namespace atlas2d {
         pixel_format    format;     ///< Pixel format
         size            dimensions; ///< Dimensions of the array
         raw_data_ptr    data;       ///< Pixel's raw data
+        palette_ptr     palette;    ///< Color table for palette-indexed formats
     };
     
     namespace details {
@@ -24,6 +26,9 @@ namespace atlas2d {
             
             /// Set a rotator for pixels fetching
             virtual void set_rotator(rotation rot);
+            
+            /// Returns the current rotator
+            rotation get_rotation() const;
 
         protected:
             ~raw_pixel_area_impl();
@@ -36,10 +41,13 @@ namespace atlas2d {
             virtual void reset();
             
             /// Reads specific row to a preallocated buffer.
-            void read_row(unsigned char* dst, int row) const;
+            virtual void read_row(unsigned char* dst, int row) const;
             
             unsigned char* get_raw_pixels() const;
             
+            /// Analyzes the pixels of the area (rotation is applied)
+            pixel_analysis analyze(analysis_params const& params) const;
+            
             size get_dimensions() const;
             pixel_format get_pixel_format() const;
             
@@ -63,7 +71,7 @@ namespace atlas2d {
             }
             
             /// Returns the properties of the area
-            PropsT const& props() { return _props; }
+            PropsT const& props() const { return _props; }
             
             // Just forward the calls above to the implementation class
             
@@ -71,6 +79,7 @@ namespace atlas2d {
             virtual unsigned char* get_raw_pixels() const { return raw_pixel_area_impl::get_raw_pixels(); }
             virtual size get_dimensions() const { return raw_pixel_area_impl::get_dimensions(); }
             virtual pixel_format get_pixel_format() const { return raw_pixel_area_impl::get_pixel_format(); }
+            virtual pixel_analysis analyze(analysis_params const& p = analysis_params()) const { return raw_pixel_area_impl::analyze(p); }
             
         protected:
             PropsT _props;
@@ -88,6 +97,7 @@ namespace atlas2d {
             init_props& set_dims(size arg) { dimensions = std::move(arg); return *this;}
             init_props& set_pixel_format(pixel_format arg) { format = std::move(arg); return *this;}
             init_props& set_raw_data(raw_data_ptr arg) {data = std::move(arg); return *this;}
+            init_props& set_palette(palette_ptr arg) {palette = std::move(arg); return *this;}
         };
     };
     
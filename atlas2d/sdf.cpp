@@ -0,0 +1,222 @@
+#include "sdf.hpp"
+#include "pixel_format.hpp"
+#include "pixel_converter.hpp"
+#include "memory_budget.hpp"
+#include "parallel.hpp"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+using namespace ::atlas2d;
+using namespace ::std;
+
+namespace {
+    
+    const float distance_inf = 1e20f;
+    
+    /// Scratch buffers of the 1D transform, charged to the account of the area
+    struct edt_scratch {
+        raw_data_ptr data;
+        float* f = nullptr;
+        float* d = nullptr;
+        float* z = nullptr;
+        int* v = nullptr;
+        
+        bool allocate(size_t n, memory_account_ptr const& account) {
+            data = details::allocate_tracked((4 * n + 1) * sizeof(float), account);
+            if(!data)
+                return false;
+            
+            f = (float*)data.get();
+            d = f + n;
+            z = d + n;
+            v = (int*)(z + n + 1);
+            return true;
+        }
+    };
+    
+    /// Squared distance transform of a sampled function (Felzenszwalb & Huttenlocher).
+    /// Builds the lower envelope of the parabolas rooted at f and samples it. O(n).
+    void edt_1d(edt_scratch& s, size_t n) {
+        float const* f = s.f;
+        float* d = s.d;
+        float* z = s.z;
+        int* v = s.v;
+        
+        int k = 0;
+        v[0] = 0;
+        z[0] = -distance_inf;
+        z[1] = distance_inf;
+        
+        for(int q = 1; q < (int)n; ++q) {
+            const float fq = f[q] + (float)q * q;
+            float sp = (fq - (f[v[k]] + (float)v[k] * v[k])) / (2.0f * (q - v[k]));
+            
+            // Drop the parabolas hidden by the new one, z[0] is -inf so it always stops
+            while(sp <= z[k]) {
+                --k;
+                sp = (fq - (f[v[k]] + (float)v[k] * v[k])) / (2.0f * (q - v[k]));
+            }
+            
+            ++k;
+            v[k] = q;
+            z[k] = sp;
+            z[k + 1] = distance_inf;
+        }
+        
+        k = 0;
+        for(int q = 0; q < (int)n; ++q) {
+            while(z[k + 1] < (float)q)
+                ++k;
+            float dq = (float)(q - v[k]);
+            d[q] = dq * dq + f[v[k]];
+        }
+    }
+    
+    /// 2D squared distance transform in place: the columns first, the rows then
+    void edt_2d(float* grid, size_t width, size_t height, edt_scratch& s) {
+        for(size_t x = 0; x < width; ++x) {
+            for(size_t y = 0; y < height; ++y)
+                s.f[y] = grid[y * width + x];
+            edt_1d(s, height);
+            for(size_t y = 0; y < height; ++y)
+                grid[y * width + x] = s.d[y];
+        }
+        
+        for(size_t y = 0; y < height; ++y) {
+            float* row = &grid[y * width];
+            copy(row, row + width, s.f);
+            edt_1d(s, width);
+            copy(s.d, s.d + width, row);
+        }
+    }
+    
+    /// Reads the source's alpha to the inside mask, the border of <spread> stays outside
+    bool read_mask(raw_pixel_area const& src, int spread, unsigned char threshold, unsigned char* mask, size_t width) {
+        auto dims = src.get_dimensions();
+        auto fmt = src.get_pixel_format();
+        auto src_bpp = (size_t)pixel_format_details(fmt).bpp;
+        
+        pixel_converter_ptr converter;
+        if(fmt != pixel_format::a8) {
+            converter = create_pixel_converter(set_converter_params()
+                                               .set_src_fmt(fmt)
+                                               .set_dst_fmt(pixel_format::a8)
+                                               .set_pixels_count(dims.width)
+                                               .set_margins(0, 0)
+                                               .set_palette(src.props().palette));
+            if(!converter)
+                return false;
+        }
+        
+        vector<unsigned char> row((size_t)dims.width * src_bpp);
+        vector<unsigned char> alpha((size_t)dims.width);
+        
+        for(int y = 0; y < dims.height; ++y) {
+            src.read_row(row.data(), y);
+            unsigned char const* a = row.data();
+            if(converter) {
+                (*converter)(row.data(), alpha.data(), dims.width);
+                a = alpha.data();
+            }
+            
+            unsigned char* dst = &mask[(size_t)(y + spread) * width + spread];
+            for(int x = 0; x < dims.width; ++x)
+                dst[x] = a[x] >= threshold;
+        }
+        return true;
+    }
+    
+} // namespace
+
+
+bool sdf_pixel_area::generate(raw_pixel_area const& src, sdf_params const& params, memory_account_ptr account) {
+    auto src_dims = src.get_dimensions();
+    if(src_dims.width <= 0 || src_dims.height <= 0 || params.spread < 0)
+        return false;
+    
+    if(params.format != pixel_format::a8 && params.format != pixel_format::rgba8)
+        return false;
+    
+    const int spread = params.spread;
+    const size_t width = (size_t)src_dims.width + 2 * spread;
+    const size_t height = (size_t)src_dims.height + 2 * spread;
+    const size_t count = width * height;
+    
+    // The scratch buffers are charged to the account for the time of the call
+    auto mask_data = details::allocate_tracked(count, account, true);
+    if(!mask_data)
+        return false;
+    
+    unsigned char const* mask = mask_data.get();
+    if(!read_mask(src, spread, params.threshold, mask_data.get(), width))
+        return false;
+    
+    const size_t bpp = (size_t)pixel_format_details(params.format).bpp;
+    auto data = details::allocate_tracked(count * bpp, account);
+    if(!data)
+        return false;
+    
+    // Distances to the nearest inside pixel and to the nearest outside pixel
+    auto grids = details::allocate_tracked(2 * count * sizeof(float), account);
+    edt_scratch scratch;
+    if(!grids || !scratch.allocate((std::max)(width, height), account))
+        return false;
+    
+    float* outside = (float*)grids.get();
+    float* inside = outside + count;
+    for(size_t i = 0; i < count; ++i) {
+        outside[i] = mask[i] ? 0.0f : distance_inf;
+        inside[i] = mask[i] ? distance_inf : 0.0f;
+    }
+    
+    edt_2d(outside, width, height, scratch);
+    edt_2d(inside, width, height, scratch);
+    
+    // The edge lies between pixel centers, hence the half pixel shift
+    const float scale = spread > 0 ? 127.0f / (float)spread : 127.0f;
+    unsigned char* out = data.get();
+    for(size_t i = 0; i < count; ++i) {
+        float distance = mask[i]
+            ? -(std::sqrt(inside[i]) - 0.5f)
+            : std::sqrt(outside[i]) - 0.5f;
+        
+        float value = 128.0f - distance * scale;
+        unsigned char v = (unsigned char)(std::min)(255.0f, (std::max)(0.0f, value + 0.5f));
+        
+        if(bpp == 1) {
+            out[i] = v;
+        }
+        else {
+            out[i * 4 + 0] = v;
+            out[i * 4 + 1] = v;
+            out[i * 4 + 2] = v;
+            out[i * 4 + 3] = v;
+        }
+    }
+    
+    init(raw_pixel_area::init_props()
+         .set_dims(size((int)width, (int)height))
+         .set_pixel_format(params.format)
+         .set_raw_data(data));
+    return true;
+}
+
+vector<sdf_pixel_area_ptr> atlas2d::generate_sdf_areas(vector<raw_pixel_area const*> const& sources,
+                                                       sdf_params const& params,
+                                                       size_t threads,
+                                                       memory_account_ptr account)
+{
+    vector<sdf_pixel_area_ptr> areas(sources.size());
+    
+    details::parallel_for(sources.size(), [&](size_t begin, size_t end, size_t){
+        for(size_t i = begin; i < end; ++i) {
+            auto area = make_shared<sdf_pixel_area>();
+            if(sources[i] && area->generate(*sources[i], params, account))
+                areas[i] = area;
+        }
+    }, threads);
+    
+    return areas;
+}
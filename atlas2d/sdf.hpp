@@ -0,0 +1,44 @@
+#pragma once
+
+#include "raw_pixel_area.hpp"
+
+#include <vector>
+
+namespace atlas2d {
+    
+    /// A set of parameters of the distance field generation
+    struct sdf_params {
+        int spread = 8;                         ///< Distance in pixels covered by the value range, also the border around the sprite
+        unsigned char threshold = 128;          ///< Alpha splitting the inside from the outside
+        pixel_format format = pixel_format::a8; ///< a8 or rgba8 (the distance is written to every channel)
+    };
+    
+    // Helper
+    struct set_sdf_params: sdf_params {
+        using self = set_sdf_params;
+        self& set_spread(int arg) {spread=arg; return *this;}
+        self& set_threshold(unsigned char arg) {threshold=arg; return *this;}
+        self& set_pixel_format(pixel_format arg) {format=arg; return *this;}
+    };
+    
+    /// A pixel area holding the signed distance field of another area's alpha.
+    /// The field is <spread> pixels wider on every side than the source, so a sprite
+    /// placed at (x, y) gets its field filled at (x - spread, y - spread).
+    /// Values above 128 are inside the shape.
+    class sdf_pixel_area: public raw_pixel_area {
+    public:
+        /// Generates the field by the exact linear time Euclidean distance transform.
+        /// The field and the scratch buffers of the transform are charged to the <account>.
+        /// Returns false if the source can't be read or the memory budget is exceeded.
+        bool generate(raw_pixel_area const& src, sdf_params const& params, memory_account_ptr account = nullptr);
+    };
+    
+    using sdf_pixel_area_ptr = std::shared_ptr<sdf_pixel_area>;
+    
+    /// Generates the fields of several sources in parallel. Failed sources get nullptr.
+    std::vector<sdf_pixel_area_ptr> generate_sdf_areas(std::vector<raw_pixel_area const*> const& sources,
+                                                       sdf_params const& params,
+                                                       size_t threads = 0,
+                                                       memory_account_ptr account = nullptr);
+    
+} // namespace atlas2d
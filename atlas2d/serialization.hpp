@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+
+namespace atlas2d {
+    
+    namespace details {
+        
+        // Little-endian serialization of integers
+        
+        template<typename T>
+        void put(std::ostream& out, T v) {
+            unsigned char bytes[sizeof(T)];
+            for(size_t i = 0; i < sizeof(T); ++i)
+                bytes[i] = (unsigned char)((uint64_t)v >> (i * 8));
+            out.write((char const*)bytes, sizeof(T));
+        }
+        
+        template<typename T>
+        bool get(std::istream& in, T& v) {
+            unsigned char bytes[sizeof(T)];
+            if(!in.read((char*)bytes, sizeof(T)))
+                return false;
+            
+            uint64_t r = 0;
+            for(size_t i = 0; i < sizeof(T); ++i)
+                r |= (uint64_t)bytes[i] << (i * 8);
+            v = (T)r;
+            return true;
+        }
+        
+        // Unsigned LEB128, 7 bits per byte with the high bit set on all bytes but the last one
+        
+        inline void put_varint(std::ostream& out, uint64_t v) {
+            unsigned char bytes[10];
+            size_t count = 0;
+            do {
+                unsigned char b = (unsigned char)(v & 0x7F);
+                v >>= 7;
+                bytes[count++] = (unsigned char)(v ? (b | 0x80) : b);
+            } while(v);
+            out.write((char const*)bytes, count);
+        }
+        
+        template<typename T>
+        bool get_varint(std::istream& in, T& v) {
+            uint64_t r = 0;
+            for(int shift = 0; shift < 64; shift += 7) {
+                char c = 0;
+                if(!in.get(c))
+                    return false;
+                
+                unsigned char b = (unsigned char)c;
+                r |= (uint64_t)(b & 0x7F) << shift;
+                if(!(b & 0x80)) {
+                    v = (T)r;
+                    return (uint64_t)v == r;
+                }
+            }
+            return false;
+        }
+        
+    } // namespace details
+    
+} // namespace atlas2d
@@ -0,0 +1,84 @@
+#include "sparse_storage.hpp"
+#include "memory_budget.hpp"
+
+#include <sys/mman.h>
+
+using namespace ::atlas2d;
+using namespace ::atlas2d::details;
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+const size_t sparse_storage::chunk_size;
+
+namespace {
+    
+    unsigned char* reserve_address_space(size_t bytes) {
+        // Anonymous pages are backed by the physical memory on the first write only,
+        // until then they are mapped to the shared zero page.
+        void* ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        return ptr == MAP_FAILED ? nullptr : (unsigned char*)ptr;
+    }
+    
+} // namespace
+
+
+sparse_storage_ptr sparse_storage::reserve(size_t bytes, memory_account_ptr account) {
+    if(!bytes)
+        return nullptr;
+    
+    // Round up to the whole chunks
+    size_t chunks = (bytes + chunk_size - 1) / chunk_size;
+    size_t reserved = chunks * chunk_size;
+    
+    unsigned char* data = reserve_address_space(reserved);
+    if(!data)
+        return nullptr;
+    
+    sparse_storage_ptr storage(new sparse_storage);
+    storage->_data = data;
+    storage->_size = reserved;
+    storage->_account = std::move(account);
+    storage->_chunks.assign(chunks, false);
+    return storage;
+}
+
+sparse_storage::~sparse_storage() {
+    if(_account)
+        _account->release(_committed_chunks * chunk_size);
+    
+    if(_data)
+        munmap(_data, _size);
+}
+
+bool sparse_storage::commit(size_t offset, size_t bytes) {
+    if(!bytes)
+        return true;
+    
+    if(offset + bytes > _size || offset + bytes < offset)
+        return false;
+    
+    const size_t first = offset / chunk_size;
+    const size_t last = (offset + bytes - 1) / chunk_size;
+    
+    std::lock_guard<std::mutex> lock(_guard);
+    for(size_t i = first; i <= last; ++i) {
+        if(_chunks[i])
+            continue;
+        
+        // The chunk is charged here and gets physical pages on the first write
+        if(_account && !_account->acquire(chunk_size))
+            return false;
+        
+        _chunks[i] = true;
+        ++_committed_chunks;
+    }
+    
+    return true;
+}
+
+size_t sparse_storage::committed() const {
+    std::lock_guard<std::mutex> lock(_guard);
+    return _committed_chunks * chunk_size;
+}
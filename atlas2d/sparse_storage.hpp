@@ -0,0 +1,58 @@
+#pragma once
+
+#include "forwards.hpp"
+
+#include <vector>
+#include <mutex>
+
+namespace atlas2d {
+    
+    namespace details {
+        
+        class sparse_storage;
+        using sparse_storage_ptr = std::shared_ptr<sparse_storage>;
+        
+        /// A reserved range of the address space. The memory is committed by chunks
+        /// when they are touched for the first time, untouched chunks stay virtual and read as zeros.
+        class sparse_storage {
+        public:
+            /// Granularity of committing
+            static const size_t chunk_size = 64 * 1024;
+            
+            /// Reserves <bytes> of the address space. Committed chunks are charged to the <account>.
+            /// Returns nullptr if the reservation fails.
+            static sparse_storage_ptr reserve(size_t bytes, memory_account_ptr account);
+            
+            ~sparse_storage();
+            
+            sparse_storage(sparse_storage const&) = delete;
+            sparse_storage& operator=(sparse_storage const&) = delete;
+            
+            /// Makes [offset, offset + bytes) range writable.
+            /// Returns false if the memory budget would be exceeded or the range is out of the storage.
+            bool commit(size_t offset, size_t bytes);
+            
+            /// Returns the beginning of the storage
+            unsigned char* data() const { return _data; }
+            
+            /// Returns the reserved size
+            size_t reserved() const { return _size; }
+            
+            /// Returns the count of committed bytes
+            size_t committed() const;
+            
+        private:
+            sparse_storage() { ;; }
+            
+            unsigned char* _data = nullptr;
+            size_t _size = 0;
+            memory_account_ptr _account;
+            
+            mutable std::mutex _guard;
+            std::vector<bool> _chunks;      ///< Committed chunks
+            size_t _committed_chunks = 0;
+        };
+        
+    } // namespace details
+    
+} // namespace atlas2d